@@ -7,15 +7,26 @@
 /*================================================== CLIPTokenizer ===================================================*/
 
 std::pair<std::unordered_map<std::string, float>, std::string> extract_and_remove_lora(std::string text) {
-    std::regex re("<lora:([^:]+):([^>]+)>");
-    std::smatch matches;
+    // removes every <lora:name:multiplier>, name runs to the first ':' and multiplier to the first '>'
+    const std::string tag = "<lora:";
     std::unordered_map<std::string, float> filename2multiplier;
 
-    while (std::regex_search(text, matches, re)) {
-        std::string filename = matches[1].str();
-        float multiplier     = std::stof(matches[2].str());
+    size_t pos = text.find(tag);
+    while (pos != std::string::npos) {
+        size_t name_begin = pos + tag.size();
+        size_t name_end   = text.find(':', name_begin);
+        size_t end        = name_end == std::string::npos ? std::string::npos : text.find('>', name_end + 1);
+        if (name_end == std::string::npos || name_end == name_begin ||
+            end == std::string::npos || end == name_end + 1) {
+            pos = text.find(tag, pos + 1);
+            continue;
+        }
+
+        std::string filename = text.substr(name_begin, name_end - name_begin);
+        float multiplier     = std::stof(text.substr(name_end + 1, end - name_end - 1));
 
-        text = std::regex_replace(text, re, "", std::regex_constants::format_first_only);
+        text.erase(pos, end + 1 - pos);
+        pos = text.find(tag);
 
         if (multiplier == 0.f) {
             continue;
@@ -63,14 +74,25 @@ typedef std::function<bool(std::string&, std::vector<int32_t>&)> on_new_token_cb
 
 class CLIPTokenizer {
 private:
-    std::map<int, std::u32string> byte_encoder;
-    std::map<std::u32string, int> byte_decoder;
-    std::map<std::u32string, int> encoder;
-    std::map<int, std::u32string> decoder;
-    std::map<std::pair<std::u32string, std::u32string>, int> bpe_ranks;
-    std::regex pat;
+    // vocabulary and merge ranks of one merges file, shared by every tokenizer built from it
+    struct Vocab {
+        std::u32string byte_encoder[256];
+        std::unordered_map<std::u32string, int> encoder;
+        std::unordered_map<int, std::u32string> decoder;
+        // first + U' ' + second => rank
+        std::unordered_map<std::u32string, int> bpe_ranks;
+        int encoder_len;
+        int bpe_len;
+    };
+
+    std::shared_ptr<const Vocab> vocab;
+    // tokens added by add_token, looked up before the shared vocabulary
+    std::unordered_map<std::u32string, int> added_encoder;
+    std::unordered_map<int, std::u32string> added_decoder;
     int encoder_len;
-    int bpe_len;
+    // pre-tokenized word => token ids
+    std::unordered_map<std::string, std::vector<int>> bpe_cache;
+    const size_t max_bpe_cache_size = 65536;
 
 public:
     const std::string UNK_TOKEN = "<|endoftext|>";
@@ -84,6 +106,18 @@ public:
     const int PAD_TOKEN_ID = 49407;
 
 private:
+    static bool is_space(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+    }
+
+    static bool is_alpha(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    }
+
+    static bool is_digit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
     static std::string strip(const std::string& str) {
         std::string::size_type start = str.find_first_not_of(" \t\n\r\v\f");
         std::string::size_type end   = str.find_last_not_of(" \t\n\r\v\f");
@@ -96,47 +130,58 @@ private:
         return str.substr(start, end - start + 1);
     }
 
-    static std::string whitespace_clean(std::string text) {
-        text = std::regex_replace(text, std::regex(R"(\s+)"), " ");
-        text = strip(text);
-        return text;
+    static std::string whitespace_clean(const std::string& text) {
+        std::string result;
+        result.reserve(text.size());
+        for (size_t i = 0; i < text.size(); i++) {
+            if (!is_space(text[i])) {
+                result += text[i];
+            } else if (i == 0 || !is_space(text[i - 1])) {
+                result += ' ';
+            }
+        }
+        return strip(result);
     }
 
-    static std::set<std::pair<std::u32string, std::u32string>> get_pairs(const std::vector<std::u32string>& subwords) {
-        std::set<std::pair<std::u32string, std::u32string>> pairs;
-        if (subwords.size() == 0) {
-            return pairs;
+    // Length of the pre-tokenizer match starting at str[pos], 0 if str[pos] is a space. Same as the regex
+    // <\|startoftext\|>|<\|endoftext\|>|'s|'t|'re|'ve|'m|'ll|'d|[[:alpha:]]+|[[:digit:]]|[^[:space:][:alpha:][:digit:]]+
+    static size_t match_word(const std::string& str, size_t pos) {
+        static const char* specials[] = {"<|startoftext|>", "<|endoftext|>", "'s", "'t", "'re", "'ve", "'m", "'ll", "'d"};
+        for (const char* special : specials) {
+            if (str.compare(pos, strlen(special), special) == 0) {
+                return strlen(special);
+            }
         }
-        std::u32string prev_subword = subwords[0];
-        for (int i = 1; i < subwords.size(); i++) {
-            std::u32string subword = subwords[i];
-            std::pair<std::u32string, std::u32string> pair(prev_subword, subword);
-            pairs.insert(pair);
-            prev_subword = subword;
+        size_t end = pos;
+        if (is_alpha(str[pos])) {
+            while (end < str.size() && is_alpha(str[end])) {
+                end++;
+            }
+        } else if (is_digit(str[pos])) {
+            end++;
+        } else {
+            while (end < str.size() && !is_space(str[end]) && !is_alpha(str[end]) && !is_digit(str[end])) {
+                end++;
+            }
         }
-        return pairs;
+        return end - pos;
     }
 
-public:
-    CLIPTokenizer(int pad_token_id = 49407, const std::string& merges_utf8_str = "")
-        : PAD_TOKEN_ID(pad_token_id) {
-        if (merges_utf8_str.size() > 0) {
-            load_from_merges(merges_utf8_str);
-        } else {
-            load_from_merges(ModelLoader::load_merges());
+    static std::shared_ptr<const Vocab> load_vocab(const std::string& merges_utf8_str) {
+        static std::mutex mutex;
+        static std::map<std::string, std::weak_ptr<const Vocab>> loaded;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<const Vocab> cached = loaded[merges_utf8_str].lock();
+        if (cached) {
+            return cached;
         }
-    }
 
-    void load_from_merges(const std::string& merges_utf8_str) {
-        auto byte_unicode_pairs = bytes_to_unicode();
-        // printf("byte_unicode_pairs have %lu pairs \n", byte_unicode_pairs.size());
-        byte_encoder = std::map<int, std::u32string>(byte_unicode_pairs.begin(), byte_unicode_pairs.end());
+        std::shared_ptr<Vocab> vocab = std::make_shared<Vocab>();
+        auto byte_unicode_pairs      = bytes_to_unicode();
         for (auto& pair : byte_unicode_pairs) {
-            byte_decoder[pair.second] = pair.first;
+            vocab->byte_encoder[pair.first] = pair.second;
         }
-        // for (auto & pair: byte_unicode_pairs) {
-        //     std::cout << pair.first << ": " << pair.second << std::endl;
-        // }
         std::vector<std::u32string> merges;
         size_t start = 0;
         size_t pos;
@@ -148,132 +193,158 @@ public:
         // LOG_DEBUG("merges size %llu", merges.size());
         GGML_ASSERT(merges.size() == 48895);
         merges = std::vector<std::u32string>(merges.begin() + 1, merges.end());
-        std::vector<std::pair<std::u32string, std::u32string>> merge_pairs;
-        for (const auto& merge : merges) {
-            size_t space_pos = merge.find(' ');
-            merge_pairs.emplace_back(merge.substr(0, space_pos), merge.substr(space_pos + 1));
-            // LOG_DEBUG("%s", utf32_to_utf8(merge.substr(space_pos + 1)).c_str());
-            // printf("%s :: %s | %s \n", utf32_to_utf8(merge).c_str(), utf32_to_utf8(merge.substr(0, space_pos)).c_str(),
-            //                     utf32_to_utf8(merge.substr(space_pos + 1)).c_str());
-        }
-        std::vector<std::u32string> vocab;
+        std::vector<std::u32string> tokens;
         for (const auto& pair : byte_unicode_pairs) {
-            vocab.push_back(pair.second);
+            tokens.push_back(pair.second);
         }
         for (const auto& pair : byte_unicode_pairs) {
-            vocab.push_back(pair.second + utf8_to_utf32("</w>"));
+            tokens.push_back(pair.second + U"</w>");
         }
-        for (const auto& merge : merge_pairs) {
-            vocab.push_back(merge.first + merge.second);
+        for (const auto& merge : merges) {
+            size_t space_pos = merge.find(' ');
+            tokens.push_back(merge.substr(0, space_pos) + merge.substr(space_pos + 1));
         }
-        vocab.push_back(utf8_to_utf32("<|startoftext|>"));
-        vocab.push_back(utf8_to_utf32("<|endoftext|>"));
-        LOG_DEBUG("vocab size: %llu", vocab.size());
+        tokens.push_back(U"<|startoftext|>");
+        tokens.push_back(U"<|endoftext|>");
+        LOG_DEBUG("vocab size: %llu", tokens.size());
+        vocab->encoder.reserve(tokens.size());
+        vocab->decoder.reserve(tokens.size());
         int i = 0;
-        for (const auto& token : vocab) {
-            encoder[token] = i;
-            decoder[i]     = token;
+        for (const auto& token : tokens) {
+            vocab->encoder[token] = i;
+            vocab->decoder[i]     = token;
             i++;
         }
-        encoder_len = i;
+        vocab->encoder_len = i;
 
-        auto it = encoder.find(utf8_to_utf32("img</w>"));
-        if (it != encoder.end()) {
+        auto it = vocab->encoder.find(U"img</w>");
+        if (it != vocab->encoder.end()) {
             LOG_DEBUG(" trigger word img already in vocab");
         } else {
             LOG_DEBUG(" trigger word img not in vocab yet");
         }
 
+        // a merge is stored as "first second", the same key bpe() builds for a pair
+        vocab->bpe_ranks.reserve(merges.size());
         int rank = 0;
-        for (const auto& merge : merge_pairs) {
-            bpe_ranks[merge] = rank++;
+        for (const auto& merge : merges) {
+            vocab->bpe_ranks[merge] = rank++;
+        }
+        vocab->bpe_len = rank;
+
+        loaded[merges_utf8_str] = vocab;
+        return vocab;
+    }
+
+    int token_to_id(const std::u32string& token) const {
+        auto it = added_encoder.find(token);
+        if (it != added_encoder.end()) {
+            return it->second;
+        }
+        auto vocab_it = vocab->encoder.find(token);
+        return vocab_it != vocab->encoder.end() ? vocab_it->second : 0;
+    }
+
+    std::u32string id_to_token(int id) const {
+        auto it = added_decoder.find(id);
+        if (it != added_decoder.end()) {
+            return it->second;
+        }
+        auto vocab_it = vocab->decoder.find(id);
+        return vocab_it != vocab->decoder.end() ? vocab_it->second : U"";
+    }
+
+    const std::vector<int>& encode_word(const std::string& word) {
+        auto it = bpe_cache.find(word);
+        if (it != bpe_cache.end()) {
+            return it->second;
+        }
+        if (bpe_cache.size() >= max_bpe_cache_size) {
+            bpe_cache.clear();
+        }
+
+        std::u32string utf32_word;
+        for (unsigned char b : word) {
+            utf32_word += vocab->byte_encoder[b];
+        }
+        std::vector<int> ids;
+        for (const auto& bpe_str : bpe(utf32_word)) {
+            ids.push_back(token_to_id(bpe_str));
         }
-        bpe_len = rank;
+        return bpe_cache.emplace(word, std::move(ids)).first->second;
+    }
+
+public:
+    CLIPTokenizer(int pad_token_id = 49407, const std::string& merges_utf8_str = "")
+        : PAD_TOKEN_ID(pad_token_id) {
+        if (merges_utf8_str.size() > 0) {
+            load_from_merges(merges_utf8_str);
+        } else {
+            load_from_merges(ModelLoader::load_merges());
+        }
+    }
+
+    void load_from_merges(const std::string& merges_utf8_str) {
+        vocab       = load_vocab(merges_utf8_str);
+        encoder_len = vocab->encoder_len;
+        added_encoder.clear();
+        added_decoder.clear();
+        bpe_cache.clear();
     };
 
     void add_token(const std::string& text) {
         std::u32string token = utf8_to_utf32(text);
-        auto it              = encoder.find(token);
-        if (it != encoder.end()) {
-            encoder[token]       = encoder_len;
-            decoder[encoder_len] = token;
+        if (added_encoder.find(token) != added_encoder.end() || vocab->encoder.find(token) != vocab->encoder.end()) {
+            added_encoder[token]       = encoder_len;
+            added_decoder[encoder_len] = token;
             encoder_len++;
+            bpe_cache.clear();
         }
     }
 
-    std::u32string bpe(const std::u32string& token) {
+    // splits a byte encoded word into its merged subwords, the last one ends with </w>
+    std::vector<std::u32string> bpe(const std::u32string& token) const {
         std::vector<std::u32string> word;
 
         for (int i = 0; i < token.size() - 1; i++) {
             word.emplace_back(1, token[i]);
         }
-        word.push_back(token.substr(token.size() - 1) + utf8_to_utf32("</w>"));
-
-        std::set<std::pair<std::u32string, std::u32string>> pairs = get_pairs(word);
-
-        if (pairs.empty()) {
-            return token + utf8_to_utf32("</w>");
-        }
-
-        while (true) {
-            auto min_pair_iter = std::min_element(pairs.begin(),
-                                                  pairs.end(),
-                                                  [&](const std::pair<std::u32string, std::u32string>& a,
-                                                      const std::pair<std::u32string, std::u32string>& b) {
-                                                      if (bpe_ranks.find(a) == bpe_ranks.end()) {
-                                                          return false;
-                                                      } else if (bpe_ranks.find(b) == bpe_ranks.end()) {
-                                                          return true;
-                                                      }
-                                                      return bpe_ranks.at(a) < bpe_ranks.at(b);
-                                                  });
-
-            const std::pair<std::u32string, std::u32string>& bigram = *min_pair_iter;
-
-            if (bpe_ranks.find(bigram) == bpe_ranks.end()) {
+        word.push_back(token.substr(token.size() - 1) + U"</w>");
+
+        std::u32string key;
+        while (word.size() > 1) {
+            int min_rank = -1;
+            size_t min_i = 0;
+            for (size_t i = 0; i + 1 < word.size(); i++) {
+                key.assign(word[i]);
+                key += U' ';
+                key += word[i + 1];
+                auto it = vocab->bpe_ranks.find(key);
+                if (it != vocab->bpe_ranks.end() && (min_rank < 0 || it->second < min_rank)) {
+                    min_rank = it->second;
+                    min_i    = i;
+                }
+            }
+            if (min_rank < 0) {
                 break;
             }
 
-            std::u32string first  = bigram.first;
-            std::u32string second = bigram.second;
+            std::u32string first  = word[min_i];
+            std::u32string second = word[min_i + 1];
             std::vector<std::u32string> new_word;
-            int32_t i = 0;
-
-            while (i < word.size()) {
-                auto it = std::find(word.begin() + i, word.end(), first);
-                if (it == word.end()) {
-                    new_word.insert(new_word.end(), word.begin() + i, word.end());
-                    break;
-                }
-                new_word.insert(new_word.end(), word.begin() + i, it);
-                i = static_cast<int32_t>(std::distance(word.begin(), it));
-
-                if (word[i] == first && i < static_cast<int32_t>(word.size()) - 1 && word[i + 1] == second) {
+            new_word.reserve(word.size() - 1);
+            for (size_t i = 0; i < word.size(); i++) {
+                if (i + 1 < word.size() && word[i] == first && word[i + 1] == second) {
                     new_word.push_back(first + second);
-                    i += 2;
+                    i++;
                 } else {
-                    new_word.push_back(word[i]);
-                    i += 1;
+                    new_word.push_back(std::move(word[i]));
                 }
             }
-
-            word = new_word;
-
-            if (word.size() == 1) {
-                break;
-            }
-            pairs = get_pairs(word);
-        }
-
-        std::u32string result;
-        for (int i = 0; i < word.size(); i++) {
-            result += word[i];
-            if (i != word.size() - 1) {
-                result += utf8_to_utf32(" ");
-            }
+            word = std::move(new_word);
         }
 
-        return result;
+        return word;
     }
 
     std::vector<int> tokenize(std::string text,
@@ -344,9 +415,15 @@ public:
     }
 
     std::string clean_up_tokenization(std::string& text) {
-        std::regex pattern(R"( ,)");
         // Replace " ," with ","
-        std::string result = std::regex_replace(text, pattern, ",");
+        std::string result;
+        result.reserve(text.size());
+        for (size_t i = 0; i < text.size(); i++) {
+            if (text[i] == ' ' && i + 1 < text.size() && text[i + 1] == ',') {
+                continue;
+            }
+            result += text[i];
+        }
         return result;
     }
 
@@ -355,7 +432,7 @@ public:
         for (int t : tokens) {
             if (t == 49406 || t == 49407)
                 continue;
-            std::u32string ts = decoder[t];
+            std::u32string ts = id_to_token(t);
             // printf("%d, %s \n", t,  utf32_to_utf8(ts).c_str());
             std::string s = utf32_to_utf8(ts);
             if (s.length() >= 4) {
@@ -368,65 +445,36 @@ public:
                 text += " " + s;
             }
         }
-        // std::vector<unsigned char> bytes;
-        // for (auto c : text){
-        //     bytes.push_back(byte_decoder[c]);
-        // }
-
-        // std::string s((char *)bytes.data());
-        // std::string s = "";
         text = clean_up_tokenization(text);
         return trim(text);
     }
 
     std::vector<int> encode(std::string text, on_new_token_cb_t on_new_token_cb) {
-        std::string original_text = text;
         std::vector<int32_t> bpe_tokens;
         text = whitespace_clean(text);
         std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return std::tolower(c); });
 
-        std::regex pat(R"(<\|startoftext\|>|<\|endoftext\|>|'s|'t|'re|'ve|'m|'ll|'d|[[:alpha:]]+|[[:digit:]]|[^[:space:][:alpha:][:digit:]]+)",
-                       std::regex::icase);
-
-        std::smatch matches;
         std::string str = text;
-        std::vector<std::string> token_strs;
-        while (std::regex_search(str, matches, pat)) {
+        while (true) {
+            size_t pos = 0;
+            size_t len = 0;
+            for (; pos < str.size(); pos++) {
+                len = match_word(str, pos);
+                if (len > 0) {
+                    break;
+                }
+            }
+            if (len == 0) {
+                break;
+            }
             bool skip = on_new_token_cb(str, bpe_tokens);
             if (skip) {
                 continue;
             }
-            for (auto& token : matches) {
-                std::string token_str = token.str();
-                std::u32string utf32_token;
-                for (int i = 0; i < token_str.length(); i++) {
-                    unsigned char b = token_str[i];
-                    utf32_token += byte_encoder[b];
-                }
-                auto bpe_strs = bpe(utf32_token);
-                size_t start  = 0;
-                size_t pos;
-                while ((pos = bpe_strs.find(' ', start)) != std::u32string::npos) {
-                    auto bpe_str = bpe_strs.substr(start, pos - start);
-                    bpe_tokens.push_back(encoder[bpe_str]);
-                    token_strs.push_back(utf32_to_utf8(bpe_str));
-
-                    start = pos + 1;
-                }
-                auto bpe_str = bpe_strs.substr(start, bpe_strs.size() - start);
-                bpe_tokens.push_back(encoder[bpe_str]);
-                token_strs.push_back(utf32_to_utf8(bpe_str));
-            }
-            str = matches.suffix();
-        }
-        std::stringstream ss;
-        ss << "[";
-        for (auto token : token_strs) {
-            ss << "\"" << token << "\", ";
+            const std::vector<int>& ids = encode_word(str.substr(pos, len));
+            bpe_tokens.insert(bpe_tokens.end(), ids.begin(), ids.end());
+            str = str.substr(pos + len);
         }
-        ss << "]";
-        // LOG_DEBUG("split prompt \"%s\" to tokens %s", original_text.c_str(), ss.str().c_str());
-        // printf("split prompt \"%s\" to tokens %s \n", original_text.c_str(), ss.str().c_str());
         return bpe_tokens;
     }
 };
@@ -312,9 +312,24 @@ struct ControlNet : public GGMLRunner {
 
     ggml_backend_buffer_t control_buffer = NULL;  // keep control output tensors in backend memory
     ggml_context* control_ctx            = NULL;
-    std::vector<struct ggml_tensor*> controls;  // (12 input block outputs, 1 middle block output) SD 1.5
-    struct ggml_tensor* guided_hint = NULL;     // guided_hint cache, for faster inference
+    std::vector<struct ggml_tensor*> controls;         // (12 input block outputs, 1 middle block output) SD 1.5
+    std::vector<struct ggml_tensor*> uncond_controls;  // second half of the batch when compute() splits it
+
+    // guided hints of the last control images, kept across generations
+    struct CachedHint {
+        uint64_t key;
+        ggml_context* ctx;
+        ggml_backend_buffer_t buffer;
+        struct ggml_tensor* guided_hint;
+        bool ready;
+    };
+    std::list<CachedHint> hint_cache;  // most recently used first
+    const size_t max_cached_hints = 4;
+
+    struct ggml_tensor* guided_hint = NULL;  // guided hint of the current control image
     bool guided_hint_cached         = false;
+    bool hint_selected              = false;
+    uint64_t hint_key               = 0;
 
     ControlNet(ggml_backend_t backend,
                std::map<std::string, enum ggml_type>& tensor_types,
@@ -325,24 +340,29 @@ struct ControlNet : public GGMLRunner {
 
     ~ControlNet() {
         free_control_ctx();
+        free_hint_cache();
     }
 
-    void alloc_control_ctx(std::vector<struct ggml_tensor*> outs) {
+    void alloc_control_ctx(std::vector<struct ggml_tensor*> outs, bool split_batch) {
         struct ggml_init_params params;
-        params.mem_size   = static_cast<size_t>(outs.size() * ggml_tensor_overhead()) + 1024 * 1024;
+        params.mem_size   = static_cast<size_t>(2 * outs.size() * ggml_tensor_overhead()) + 1024 * 1024;
         params.mem_buffer = NULL;
         params.no_alloc   = true;
         control_ctx       = ggml_init(params);
 
         controls.resize(outs.size() - 1);
+        uncond_controls.resize(split_batch ? outs.size() - 1 : 0);
 
         size_t control_buffer_size = 0;
 
-        guided_hint = ggml_dup_tensor(control_ctx, outs[0]);
-        control_buffer_size += ggml_nbytes(guided_hint);
-
         for (int i = 0; i < outs.size() - 1; i++) {
-            controls[i] = ggml_dup_tensor(control_ctx, outs[i + 1]);
+            int64_t ne[4] = {outs[i + 1]->ne[0], outs[i + 1]->ne[1], outs[i + 1]->ne[2], outs[i + 1]->ne[3]};
+            if (split_batch) {
+                ne[3] /= 2;
+                uncond_controls[i] = ggml_new_tensor(control_ctx, outs[i + 1]->type, 4, ne);
+                control_buffer_size += ggml_nbytes(uncond_controls[i]);
+            }
+            controls[i] = ggml_new_tensor(control_ctx, outs[i + 1]->type, 4, ne);
             control_buffer_size += ggml_nbytes(controls[i]);
         }
 
@@ -360,9 +380,86 @@ struct ControlNet : public GGMLRunner {
             ggml_free(control_ctx);
             control_ctx = NULL;
         }
+        // a guided hint whose compute never finished can't be reused
+        for (auto it = hint_cache.begin(); it != hint_cache.end();) {
+            if (!it->ready) {
+                free_cached_hint(*it);
+                it = hint_cache.erase(it);
+            } else {
+                ++it;
+            }
+        }
         guided_hint        = NULL;
         guided_hint_cached = false;
+        hint_selected      = false;
         controls.clear();
+        uncond_controls.clear();
+    }
+
+    static void free_cached_hint(CachedHint& entry) {
+        if (entry.buffer != NULL) {
+            ggml_backend_buffer_free(entry.buffer);
+        }
+        if (entry.ctx != NULL) {
+            ggml_free(entry.ctx);
+        }
+    }
+
+    void free_hint_cache() {
+        for (auto& entry : hint_cache) {
+            free_cached_hint(entry);
+        }
+        hint_cache.clear();
+    }
+
+    static uint64_t get_hint_key(struct ggml_tensor* hint) {
+        // FNV-1a over the shape and the pixels
+        uint64_t key = 14695981039346656037ULL;
+        auto mix     = [&](const uint8_t* data, size_t size) {
+            for (size_t i = 0; i < size; i++) {
+                key = (key ^ data[i]) * 1099511628211ULL;
+            }
+        };
+        mix((const uint8_t*)hint->ne, sizeof(hint->ne));
+        mix((const uint8_t*)&hint->type, sizeof(hint->type));
+        mix((const uint8_t*)hint->data, ggml_nbytes(hint));
+        return key;
+    }
+
+    // reuses the guided hint of an earlier generation with the same control image
+    void select_hint(struct ggml_tensor* hint) {
+        hint_key = get_hint_key(hint);
+        for (auto it = hint_cache.begin(); it != hint_cache.end(); ++it) {
+            if (it->key == hint_key && it->ready) {
+                hint_cache.splice(hint_cache.begin(), hint_cache, it);
+                guided_hint        = it->guided_hint;
+                guided_hint_cached = true;
+                LOG_DEBUG("reusing the guided hint of the control image");
+                return;
+            }
+        }
+        guided_hint        = NULL;
+        guided_hint_cached = false;
+    }
+
+    struct ggml_tensor* new_cached_hint(struct ggml_tensor* like) {
+        while (hint_cache.size() >= max_cached_hints) {
+            free_cached_hint(hint_cache.back());
+            hint_cache.pop_back();
+        }
+        struct ggml_init_params params;
+        params.mem_size   = ggml_tensor_overhead() + 1024;
+        params.mem_buffer = NULL;
+        params.no_alloc   = true;
+
+        CachedHint entry;
+        entry.key         = hint_key;
+        entry.ctx         = ggml_init(params);
+        entry.guided_hint = ggml_dup_tensor(entry.ctx, like);
+        entry.buffer      = ggml_backend_alloc_ctx_tensors(entry.ctx, backend);
+        entry.ready       = false;
+        hint_cache.push_front(entry);
+        return entry.guided_hint;
     }
 
     std::string get_desc() {
@@ -377,7 +474,8 @@ struct ControlNet : public GGMLRunner {
                                     struct ggml_tensor* hint,
                                     struct ggml_tensor* timesteps,
                                     struct ggml_tensor* context,
-                                    struct ggml_tensor* y = NULL) {
+                                    struct ggml_tensor* y,
+                                    bool split_batch) {
         struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, CONTROL_NET_GRAPH_SIZE, false);
 
         x = to_backend(x);
@@ -399,35 +497,63 @@ struct ControlNet : public GGMLRunner {
                                         y);
 
         if (control_ctx == NULL) {
-            alloc_control_ctx(outs);
+            alloc_control_ctx(outs, split_batch);
         }
 
-        ggml_build_forward_expand(gf, ggml_cpy(compute_ctx, outs[0], guided_hint));
+        if (!guided_hint_cached) {
+            if (guided_hint == NULL) {
+                guided_hint = new_cached_hint(outs[0]);
+            }
+            ggml_build_forward_expand(gf, ggml_cpy(compute_ctx, outs[0], guided_hint));
+        }
         for (int i = 0; i < outs.size() - 1; i++) {
-            ggml_build_forward_expand(gf, ggml_cpy(compute_ctx, outs[i + 1], controls[i]));
+            auto out = outs[i + 1];
+            if (!split_batch) {
+                ggml_build_forward_expand(gf, ggml_cpy(compute_ctx, out, controls[i]));
+                continue;
+            }
+            int64_t n       = out->ne[3] / 2;
+            auto cond_out   = ggml_view_4d(compute_ctx, out, out->ne[0], out->ne[1], out->ne[2], n, out->nb[1], out->nb[2], out->nb[3], 0);
+            auto uncond_out = ggml_view_4d(compute_ctx, out, out->ne[0], out->ne[1], out->ne[2], n, out->nb[1], out->nb[2], out->nb[3], n * out->nb[3]);
+            ggml_build_forward_expand(gf, ggml_cpy(compute_ctx, cond_out, controls[i]));
+            ggml_build_forward_expand(gf, ggml_cpy(compute_ctx, uncond_out, uncond_controls[i]));
         }
 
         return gf;
     }
 
+    // With split_batch, x holds the cond batch followed by the uncond batch, their controls go to
+    // controls and uncond_controls. The guided hint only depends on hint and is computed once.
     void compute(int n_threads,
                  struct ggml_tensor* x,
                  struct ggml_tensor* hint,
                  struct ggml_tensor* timesteps,
                  struct ggml_tensor* context,
                  struct ggml_tensor* y,
-                 struct ggml_tensor** output     = NULL,
-                 struct ggml_context* output_ctx = NULL) {
+                 bool split_batch = false) {
         // x: [N, in_channels, h, w]
         // timesteps: [N, ]
         // context: [N, max_position, hidden_size]([N, 77, 768]) or [1, max_position, hidden_size]
         // y: [N, adm_in_channels] or [1, adm_in_channels]
+        if (!hint_selected) {
+            select_hint(hint);
+            hint_selected = true;
+        }
         auto get_graph = [&]() -> struct ggml_cgraph* {
-            return build_graph(x, hint, timesteps, context, y);
+            return build_graph(x, hint, timesteps, context, y, split_batch);
         };
 
-        GGMLRunner::compute(get_graph, n_threads, false, output, output_ctx);
+        std::vector<struct ggml_tensor*> inputs = {x, timesteps, context, y};
+        std::string key                         = "control_net:" + std::to_string(split_batch);
+        if (!guided_hint_cached) {
+            inputs.push_back(hint);
+            key += ":hint";
+        }
+        GGMLRunner::compute_cached(get_graph, inputs, key, n_threads);
         guided_hint_cached = true;
+        if (!hint_cache.empty() && hint_cache.front().guided_hint == guided_hint) {
+            hint_cache.front().ready = true;
+        }
     }
 
     bool load_from_file(const std::string& file_path) {
@@ -1377,4 +1377,189 @@ static void sample_k_diffusion(sample_method_t method,
     }
 }
 
+// Sampler state kept in a buffer of the backend, the per step arithmetic runs there as small graphs.
+#define SAMPLER_MAX_SCALARS 16
+
+struct SamplerRunner : public GGMLRunner {
+    typedef std::function<ggml_tensor*(ggml_context*, const std::vector<ggml_tensor*>&)> op_cb_t;
+
+    int n_threads;
+    // device tensor => host tensor uploaded by alloc()
+    std::vector<std::pair<ggml_tensor*, ggml_tensor*>> initial_data;
+    // values of the current run(), uploaded with every compute
+    struct ggml_context* scalars_ctx = NULL;
+    ggml_tensor* scalars             = NULL;
+
+    SamplerRunner(ggml_backend_t backend, int n_threads)
+        : GGMLRunner(backend), n_threads(n_threads) {
+        struct ggml_init_params params;
+        params.mem_size   = ggml_tensor_overhead() + SAMPLER_MAX_SCALARS * sizeof(float) + 1024;
+        params.mem_buffer = NULL;
+        params.no_alloc   = false;
+
+        scalars_ctx = ggml_init(params);
+        GGML_ASSERT(scalars_ctx != NULL);
+        scalars = ggml_new_tensor_1d(scalars_ctx, GGML_TYPE_F32, SAMPLER_MAX_SCALARS);
+    }
+
+    ~SamplerRunner() {
+        ggml_free(scalars_ctx);
+    }
+
+    std::string get_desc() {
+        return "sampler";
+    }
+
+    // must be called before alloc(), init is copied in once the tensor is allocated
+    ggml_tensor* new_tensor(ggml_tensor* like, ggml_tensor* init = NULL) {
+        ggml_tensor* tensor = ggml_dup_tensor(params_ctx, like);
+        if (init != NULL) {
+            initial_data.push_back({tensor, init});
+        }
+        return tensor;
+    }
+
+    bool alloc() {
+        if (!alloc_params_buffer()) {
+            return false;
+        }
+        for (auto& kv : initial_data) {
+            set(kv.first, kv.second);
+        }
+        initial_data.clear();
+        return true;
+    }
+
+    // dst = op(ctx, s), computed on the backend. The graph is built once per key and reused, so
+    // op has to read the same tensors and build the same graph for every call with that key.
+    // What changes from call to call goes in values, op gets them as the [1] tensors s.
+    void run(const std::string& key, const std::vector<float>& values, op_cb_t op, ggml_tensor* dst) {
+        GGML_ASSERT(values.size() <= SAMPLER_MAX_SCALARS);
+        if (values.size() > 0) {
+            memcpy(scalars->data, values.data(), values.size() * sizeof(float));
+        }
+        auto get_graph = [&]() -> struct ggml_cgraph* {
+            struct ggml_cgraph* gf = ggml_new_graph(compute_ctx);
+            ggml_tensor* all       = to_backend(scalars);
+            std::vector<ggml_tensor*> s;
+            for (size_t i = 0; i < values.size(); i++) {
+                s.push_back(ggml_view_1d(compute_ctx, all, 1, i * sizeof(float)));
+            }
+            ggml_build_forward_expand(gf, ggml_cpy(compute_ctx, op(compute_ctx, s), dst));
+            return gf;
+        };
+        GGMLRunner::compute_cached(get_graph, {scalars}, key + ":" + std::to_string(values.size()), n_threads);
+    }
+
+    void set(ggml_tensor* dst, ggml_tensor* src) {
+        ggml_backend_tensor_set(dst, src->data, 0, ggml_nbytes(dst));
+    }
+
+    void get(ggml_tensor* src, ggml_tensor* dst) {
+        ggml_backend_tensor_get(src, dst->data, 0, ggml_nbytes(src));
+    }
+};
+
+static bool sampler_supports_backend(sample_method_t method) {
+    return method == EULER_A || method == EULER || method == DPMPP2M;
+}
+
+// Same as sample_k_diffusion() with x and the sampler state resident on the backend of runner,
+// model takes and returns tensors of the backend. Only x_0 is copied back into x.
+// Tensors created on runner by the caller are allocated along with the sampler state.
+static void sample_k_diffusion_backend(sample_method_t method,
+                                       denoise_cb_t model,
+                                       SamplerRunner& runner,
+                                       ggml_context* work_ctx,
+                                       ggml_tensor* x,
+                                       std::vector<float> sigmas,
+                                       std::shared_ptr<RNG> rng) {
+    GGML_ASSERT(sampler_supports_backend(method));
+    size_t steps = sigmas.size() - 1;
+
+    ggml_tensor* x_dev            = runner.new_tensor(x, x);
+    ggml_tensor* noise_dev        = runner.new_tensor(x);
+    ggml_tensor* old_denoised_dev = runner.new_tensor(x);
+    GGML_ASSERT(runner.alloc());
+
+    ggml_tensor* noise = NULL;
+    if (method == EULER_A) {
+        noise = ggml_dup_tensor(work_ctx, x);
+    }
+
+    for (int i = 0; i < steps; i++) {
+        float sigma           = sigmas[i];
+        ggml_tensor* denoised = model(x_dev, sigma, i + 1);
+
+        switch (method) {
+            case EULER_A: {
+                float sigma_up   = std::min(sigmas[i + 1],
+                                            std::sqrt(sigmas[i + 1] * sigmas[i + 1] * (sigmas[i] * sigmas[i] - sigmas[i + 1] * sigmas[i + 1]) / (sigmas[i] * sigmas[i])));
+                float sigma_down = std::sqrt(sigmas[i + 1] * sigmas[i + 1] - sigma_up * sigma_up);
+                float dt         = sigma_down - sigmas[i];
+                bool add_noise   = sigmas[i + 1] > 0;
+                if (add_noise) {
+                    ggml_tensor_set_f32_randn(noise, rng);
+                    runner.set(noise_dev, noise);
+                }
+                // x = x + (x - denoised) / sigma * dt + noise * sigma_up
+                auto step = [&](ggml_context* ctx, const std::vector<ggml_tensor*>& s) -> ggml_tensor* {
+                    auto d   = ggml_mul(ctx, ggml_sub(ctx, x_dev, denoised), s[0]);
+                    auto out = ggml_add(ctx, x_dev, ggml_mul(ctx, d, s[1]));
+                    if (add_noise) {
+                        out = ggml_add(ctx, out, ggml_mul(ctx, noise_dev, s[2]));
+                    }
+                    return out;
+                };
+                runner.run(add_noise ? "euler_a:noise" : "euler_a", {1.f / sigma, dt, sigma_up}, step, x_dev);
+            } break;
+            case EULER: {
+                float dt = sigmas[i + 1] - sigma;
+                // x = x + (x - denoised) / sigma * dt
+                auto step = [&](ggml_context* ctx, const std::vector<ggml_tensor*>& s) -> ggml_tensor* {
+                    auto d = ggml_mul(ctx, ggml_sub(ctx, x_dev, denoised), s[0]);
+                    return ggml_add(ctx, x_dev, ggml_mul(ctx, d, s[1]));
+                };
+                runner.run("euler", {1.f / sigma, dt}, step, x_dev);
+            } break;
+            case DPMPP2M: {
+                auto t_fn    = [](float sigma) -> float { return -log(sigma); };
+                float t      = t_fn(sigmas[i]);
+                float t_next = t_fn(sigmas[i + 1]);
+                float h      = t_next - t;
+                float a      = sigmas[i + 1] / sigmas[i];
+                float b      = exp(-h) - 1.f;
+                float r      = 0.f;
+                bool simple  = i == 0 || sigmas[i + 1] == 0;
+                if (!simple) {
+                    float h_last = t - t_fn(sigmas[i - 1]);
+                    r            = h_last / h;
+                }
+                // x = a * x - b * denoised_d
+                auto step = [&](ggml_context* ctx, const std::vector<ggml_tensor*>& s) -> ggml_tensor* {
+                    auto denoised_d = denoised;
+                    if (!simple) {
+                        denoised_d = ggml_sub(ctx,
+                                              ggml_mul(ctx, denoised, s[2]),
+                                              ggml_mul(ctx, old_denoised_dev, s[3]));
+                    }
+                    return ggml_sub(ctx, ggml_mul(ctx, x_dev, s[0]), ggml_mul(ctx, denoised_d, s[1]));
+                };
+                std::vector<float> values = {a, b};
+                if (!simple) {
+                    values.push_back(1.f + 1.f / (2.f * r));
+                    values.push_back(1.f / (2.f * r));
+                }
+                runner.run(simple ? "dpmpp2m:simple" : "dpmpp2m", values, step, x_dev);
+                // old_denoised = denoised
+                ggml_backend_tensor_copy(denoised, old_denoised_dev);
+            } break;
+            default:
+                break;
+        }
+    }
+
+    runner.get(x_dev, x);
+}
+
 #endif  // __DENOISER_HPP__
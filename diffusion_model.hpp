@@ -26,6 +26,9 @@ struct DiffusionModel {
     virtual void get_param_tensors(std::map<std::string, struct ggml_tensor*>& tensors) = 0;
     virtual size_t get_params_buffer_size()                                             = 0;
     virtual int64_t get_adm_in_channels()                                               = 0;
+    virtual void get_runtime_lora_targets(std::set<struct ggml_tensor*>& targets)       = 0;
+    virtual StepCache* get_step_cache()                                                 = 0;
+    virtual RuntimeLoraMap* get_runtime_lora_map()                                      = 0;
 };
 
 struct UNetModel : public DiffusionModel {
@@ -58,6 +61,18 @@ struct UNetModel : public DiffusionModel {
         return unet.get_params_buffer_size();
     }
 
+    void get_runtime_lora_targets(std::set<struct ggml_tensor*>& targets) {
+        unet.unet.get_runtime_lora_targets(targets);
+    }
+
+    StepCache* get_step_cache() {
+        return &unet.step_cache;
+    }
+
+    RuntimeLoraMap* get_runtime_lora_map() {
+        return &unet.runtime_loras;
+    }
+
     int64_t get_adm_in_channels() {
         return unet.unet.adm_in_channels;
     }
@@ -109,6 +124,18 @@ struct MMDiTModel : public DiffusionModel {
         return mmdit.get_params_buffer_size();
     }
 
+    void get_runtime_lora_targets(std::set<struct ggml_tensor*>& targets) {
+        mmdit.mmdit.get_runtime_lora_targets(targets);
+    }
+
+    StepCache* get_step_cache() {
+        return &mmdit.step_cache;
+    }
+
+    RuntimeLoraMap* get_runtime_lora_map() {
+        return &mmdit.runtime_loras;
+    }
+
     int64_t get_adm_in_channels() {
         return 768 + 1280;
     }
@@ -162,6 +189,18 @@ struct FluxModel : public DiffusionModel {
         return flux.get_params_buffer_size();
     }
 
+    void get_runtime_lora_targets(std::set<struct ggml_tensor*>& targets) {
+        flux.flux.get_runtime_lora_targets(targets);
+    }
+
+    StepCache* get_step_cache() {
+        return &flux.step_cache;
+    }
+
+    RuntimeLoraMap* get_runtime_lora_map() {
+        return &flux.runtime_loras;
+    }
+
     int64_t get_adm_in_channels() {
         return 768;
     }
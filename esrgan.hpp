@@ -190,7 +190,8 @@ struct ESRGAN : public GGMLRunner {
         auto get_graph = [&]() -> struct ggml_cgraph* {
             return build_graph(x);
         };
-        GGMLRunner::compute(get_graph, n_threads, false, output, output_ctx);
+        // tiles share the graph, the caller frees the compute buffer when done
+        GGMLRunner::compute_cached(get_graph, {x}, "esrgan", n_threads, output, output_ctx);
     }
 };
 
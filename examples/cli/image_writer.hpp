@@ -0,0 +1,272 @@
+#ifndef __IMAGE_WRITER_HPP__
+#define __IMAGE_WRITER_HPP__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <initializer_list>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "stable-diffusion.h"
+
+// the deflate implementation comes with the zip library
+#define MINIZ_HEADER_FILE_ONLY
+#include "miniz.h"
+
+// PNG writer that filters and deflates the image on several threads. The filtered rows are
+// split into chunks that are compressed independently, like pigz does: every chunk is a raw
+// deflate stream ended with a sync flush, so the chunks concatenate into one zlib stream.
+// Level 0 stores the rows unfiltered and uncompressed, for intermediate files where only the
+// write speed matters.
+
+// chunks are at least this big, smaller ones cost too much compression ratio
+#define PNG_MIN_CHUNK_SIZE (256 * 1024)
+
+inline int png_paeth(int a, int b, int c) {
+    int p  = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return a;
+    }
+    if (pb <= pc) {
+        return b;
+    }
+    return c;
+}
+
+// prev is NULL for the first row, which filters against zeros
+inline void png_filter_row(const uint8_t* row, const uint8_t* prev, int row_size, int n, int type, uint8_t* out) {
+    for (int i = 0; i < row_size; i++) {
+        int a = i >= n ? row[i - n] : 0;
+        int b = prev != NULL ? prev[i] : 0;
+        int c = i >= n && prev != NULL ? prev[i - n] : 0;
+        switch (type) {
+            case 0:
+                out[i] = row[i];
+                break;
+            case 1:
+                out[i] = (uint8_t)(row[i] - a);
+                break;
+            case 2:
+                out[i] = (uint8_t)(row[i] - b);
+                break;
+            case 3:
+                out[i] = (uint8_t)(row[i] - ((a + b) >> 1));
+                break;
+            default:
+                out[i] = (uint8_t)(row[i] - png_paeth(a, b, c));
+                break;
+        }
+    }
+}
+
+// picks the filter with the smallest sum of the signed residuals, as stb_image_write does
+inline void png_filter_rows(const sd_image_t& image, int level, int begin, int end, uint8_t* filtered) {
+    int row_size = (int)(image.width * image.channel);
+    for (int y = begin; y < end; y++) {
+        const uint8_t* row  = image.data + (size_t)y * row_size;
+        const uint8_t* prev = y > 0 ? row - row_size : NULL;
+        uint8_t* out        = filtered + (size_t)y * (row_size + 1);
+        if (level == 0) {
+            out[0] = 0;
+            memcpy(out + 1, row, row_size);
+            continue;
+        }
+        int best_type = 0;
+        int64_t best  = INT64_MAX;
+        for (int type = 0; type < 5; type++) {
+            png_filter_row(row, prev, row_size, image.channel, type, out + 1);
+            int64_t sum = 0;
+            for (int i = 1; i <= row_size; i++) {
+                sum += abs((int8_t)out[i]);
+            }
+            if (sum < best) {
+                best      = sum;
+                best_type = type;
+            }
+        }
+        if (best_type != 4) {
+            png_filter_row(row, prev, row_size, image.channel, best_type, out + 1);
+        }
+        out[0] = (uint8_t)best_type;
+    }
+}
+
+inline bool png_deflate_chunk(const uint8_t* data, size_t size, int level, bool last, std::vector<uint8_t>& out) {
+    mz_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (mz_deflateInit2(&stream, level, MZ_DEFLATED, -MZ_DEFAULT_WINDOW_BITS, 9, MZ_DEFAULT_STRATEGY) != MZ_OK) {
+        return false;
+    }
+    // room for the empty stored block of the sync flush
+    out.resize(mz_deflateBound(&stream, (mz_ulong)size) + 16);
+    stream.next_in   = data;
+    stream.avail_in  = (unsigned int)size;
+    stream.next_out  = out.data();
+    stream.avail_out = (unsigned int)out.size();
+
+    int status = mz_deflate(&stream, last ? MZ_FINISH : MZ_SYNC_FLUSH);
+    bool ok    = last ? status == MZ_STREAM_END : status == MZ_OK && stream.avail_in == 0;
+    out.resize(stream.total_out);
+    mz_deflateEnd(&stream);
+    return ok;
+}
+
+// adler32 of the concatenation of two blocks, len2 is the size of the second one
+inline uint32_t png_adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2) {
+    const uint32_t base = 65521;
+    uint32_t rem        = (uint32_t)(len2 % base);
+    uint32_t sum1       = adler1 & 0xffff;
+    uint32_t sum2       = (uint32_t)(((uint64_t)rem * sum1) % base);
+    sum1 += (adler2 & 0xffff) + base - 1;
+    sum2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + base - rem;
+    if (sum1 >= base) {
+        sum1 -= base;
+    }
+    if (sum1 >= base) {
+        sum1 -= base;
+    }
+    if (sum2 >= (base << 1)) {
+        sum2 -= (base << 1);
+    }
+    if (sum2 >= base) {
+        sum2 -= base;
+    }
+    return sum1 | (sum2 << 16);
+}
+
+struct PNGFileWriter {
+    FILE* fp = NULL;
+    bool ok  = true;
+
+    void write(const void* data, size_t size) {
+        if (ok && size > 0) {
+            ok = fwrite(data, 1, size, fp) == size;
+        }
+    }
+
+    void write_u32(uint32_t value) {
+        uint8_t buf[4] = {(uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value};
+        write(buf, 4);
+    }
+
+    // a chunk whose data is the concatenation of parts
+    void write_chunk(const char* tag, std::initializer_list<std::pair<const void*, size_t>> parts) {
+        size_t size = 0;
+        for (auto& part : parts) {
+            size += part.second;
+        }
+        write_u32((uint32_t)size);
+        write(tag, 4);
+        mz_ulong crc = mz_crc32(MZ_CRC32_INIT, (const uint8_t*)tag, 4);
+        for (auto& part : parts) {
+            write(part.first, part.second);
+            crc = mz_crc32(crc, (const uint8_t*)part.first, part.second);
+        }
+        write_u32((uint32_t)crc);
+    }
+};
+
+// level is the deflate level 0-9, parameters goes into a tEXt chunk when not NULL
+inline bool write_png(const std::string& path, const sd_image_t& image, const char* parameters, int level, int n_threads) {
+    static const int color_types[5] = {-1, 0, 4, 2, 6};
+    if (image.data == NULL || image.width == 0 || image.height == 0 || image.channel < 1 || image.channel > 4) {
+        return false;
+    }
+    level     = std::max(0, std::min(level, 9));
+    n_threads = std::max(1, n_threads);
+
+    int width          = (int)image.width;
+    int height         = (int)image.height;
+    size_t filtered_row = (size_t)width * image.channel + 1;
+    std::vector<uint8_t> filtered(filtered_row * height);
+
+    // the rows are split into chunks that are filtered and compressed by the same thread
+    size_t chunk_size  = std::max((size_t)PNG_MIN_CHUNK_SIZE, (filtered.size() + n_threads - 1) / n_threads);
+    int rows_per_chunk = (int)std::max((size_t)1, chunk_size / filtered_row);
+    int n_chunks       = (height + rows_per_chunk - 1) / rows_per_chunk;
+
+    std::vector<std::vector<uint8_t>> compressed(n_chunks);
+    std::vector<uint32_t> adlers(n_chunks);
+    std::atomic<int> next_chunk(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&]() {
+        for (int i = next_chunk++; i < n_chunks && !failed; i = next_chunk++) {
+            int begin = i * rows_per_chunk;
+            int end   = std::min(height, begin + rows_per_chunk);
+            png_filter_rows(image, level, begin, end, filtered.data());
+
+            const uint8_t* data = filtered.data() + begin * filtered_row;
+            size_t size         = (end - begin) * filtered_row;
+            adlers[i]           = (uint32_t)mz_adler32(MZ_ADLER32_INIT, data, size);
+            if (!png_deflate_chunk(data, size, level, i == n_chunks - 1, compressed[i])) {
+                failed = true;
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int i = 1; i < std::min(n_threads, n_chunks); i++) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : workers) {
+        thread.join();
+    }
+    if (failed) {
+        return false;
+    }
+
+    uint32_t adler = adlers[0];
+    for (int i = 1; i < n_chunks; i++) {
+        int rows = std::min(height, (i + 1) * rows_per_chunk) - i * rows_per_chunk;
+        adler    = png_adler32_combine(adler, adlers[i], rows * filtered_row);
+    }
+
+    PNGFileWriter writer;
+    writer.fp = fopen(path.c_str(), "wb");
+    if (writer.fp == NULL) {
+        return false;
+    }
+    static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    writer.write(signature, sizeof(signature));
+
+    uint8_t header[13] = {
+        (uint8_t)(width >> 24), (uint8_t)(width >> 16), (uint8_t)(width >> 8), (uint8_t)width,
+        (uint8_t)(height >> 24), (uint8_t)(height >> 16), (uint8_t)(height >> 8), (uint8_t)height,
+        8, (uint8_t)color_types[image.channel], 0, 0, 0};
+    writer.write_chunk("IHDR", {{header, sizeof(header)}});
+
+    if (parameters != NULL) {
+        const char keyword[] = "parameters";  // written with its null separator
+        writer.write_chunk("tEXt", {{keyword, sizeof(keyword)}, {parameters, strlen(parameters)}});
+    }
+
+    // one IDAT per chunk, the zlib header goes in front of the first and the adler32 after the last
+    const uint8_t zlib_header[2] = {0x78, 0x9c};
+    const uint8_t zlib_footer[4] = {(uint8_t)(adler >> 24), (uint8_t)(adler >> 16), (uint8_t)(adler >> 8), (uint8_t)adler};
+    for (int i = 0; i < n_chunks; i++) {
+        writer.write_chunk("IDAT", {{zlib_header, i == 0 ? sizeof(zlib_header) : 0},
+                                    {compressed[i].data(), compressed[i].size()},
+                                    {zlib_footer, i == n_chunks - 1 ? sizeof(zlib_footer) : 0}});
+        std::vector<uint8_t>().swap(compressed[i]);
+    }
+    writer.write_chunk("IEND", {});
+
+    if (fclose(writer.fp) != 0) {
+        writer.ok = false;
+    }
+    if (!writer.ok) {
+        remove(path.c_str());
+    }
+    return writer.ok;
+}
+
+#endif  // __IMAGE_WRITER_HPP__
@@ -1,9 +1,15 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <random>
 #include <string>
+#include <thread>
 #include <vector>
 
 // #include "preprocessing.hpp"
@@ -22,6 +28,8 @@
 #define STB_IMAGE_RESIZE_STATIC
 #include "stb_image_resize.h"
 
+#include "image_writer.hpp"
+
 const char* rng_type_to_str[] = {
     "std_default",
     "cuda",
@@ -88,10 +96,12 @@ struct SDParams {
     sd_type_t wtype = SD_TYPE_COUNT;
     std::string lora_model_dir;
     std::string output_path = "output.png";
+    int png_compression     = 3;
     std::string input_path;
     std::string mask_path;
     std::string control_image_path;
     std::vector<std::string> ref_image_paths;
+    std::string profile_path;
 
     std::string prompt;
     std::string negative_prompt;
@@ -126,6 +136,13 @@ struct SDParams {
     bool diffusion_flash_attn     = false;
     bool canny_preprocess         = false;
     bool color                    = false;
+    bool batch_sampling           = false;
+    bool fused_cfg                = false;
+    int tile_batch                = 1;
+    bool lora_runtime             = false;
+    bool sampler_on_backend       = false;
+    int cond_cache_mb             = 0;
+    float step_cache_threshold    = 0.f;
     int upscale_repeats           = 1;
 
     std::vector<int> skip_layers = {7, 8, 9};
@@ -158,9 +175,11 @@ void print_params(SDParams params) {
     printf("    style ratio:       %.2f\n", params.style_ratio);
     printf("    normalize input image :  %s\n", params.normalize_input ? "true" : "false");
     printf("    output_path:       %s\n", params.output_path.c_str());
+    printf("    png_compression:   %d\n", params.png_compression);
     printf("    init_img:          %s\n", params.input_path.c_str());
     printf("    mask_img:          %s\n", params.mask_path.c_str());
     printf("    control_image:     %s\n", params.control_image_path.c_str());
+    printf("    profile_path:      %s\n", params.profile_path.c_str());
     printf("    ref_images_paths:\n");
     for (auto& path : params.ref_image_paths) {
         printf("        %s\n", path.c_str());
@@ -187,6 +206,13 @@ void print_params(SDParams params) {
     printf("    rng:               %s\n", rng_type_to_str[params.rng_type]);
     printf("    seed:              %ld\n", params.seed);
     printf("    batch_count:       %d\n", params.batch_count);
+    printf("    batch_sampling:    %s\n", params.batch_sampling ? "true" : "false");
+    printf("    fused_cfg:         %s\n", params.fused_cfg ? "true" : "false");
+    printf("    tile_batch:        %d\n", params.tile_batch);
+    printf("    lora_runtime:      %s\n", params.lora_runtime ? "true" : "false");
+    printf("    sampler_on_backend: %s\n", params.sampler_on_backend ? "true" : "false");
+    printf("    cond_cache_mb:     %d\n", params.cond_cache_mb);
+    printf("    step_cache_threshold: %.3f\n", params.step_cache_threshold);
     printf("    vae_tiling:        %s\n", params.vae_tiling ? "true" : "false");
     printf("    upscale_repeats:   %d\n", params.upscale_repeats);
     printf("    chroma_use_dit_mask:   %s\n", params.chroma_use_dit_mask ? "true" : "false");
@@ -219,11 +245,16 @@ void print_usage(int argc, const char* argv[]) {
     printf("  --type [TYPE]                      weight type (examples: f32, f16, q4_0, q4_1, q5_0, q5_1, q8_0, q2_K, q3_K, q4_K)\n");
     printf("                                     If not specified, the default is the type of the weight file\n");
     printf("  --lora-model-dir [DIR]             lora model directory\n");
+    printf("  --lora-runtime                     apply the LoRAs of the diffusion model in its forward pass instead of\n");
+    printf("                                     merging them, keeps quantized weights untouched\n");
     printf("  -i, --init-img [IMAGE]             path to the input image, required by img2img\n");
     printf("  --mask [MASK]                      path to the mask image, required by img2img with mask\n");
     printf("  --control-image [IMAGE]            path to image condition, control net\n");
     printf("  -r, --ref_image [PATH]             reference image for Flux Kontext models (can be used multiple times) \n");
     printf("  -o, --output OUTPUT                path to write result image to (default: ./output.png)\n");
+    printf("  --png-compression LEVEL            deflate level of PNG outputs, 0 (stored, fastest) to 9 (default: 3)\n");
+    printf("  --profile PATH                     append the time of every stage, step and model compute to PATH,\n");
+    printf("                                     one JSON object per line\n");
     printf("  -p, --prompt [PROMPT]              the prompt to render\n");
     printf("  -n, --negative-prompt PROMPT       the negative prompt (default: \"\")\n");
     printf("  --cfg-scale SCALE                  unconditional guidance scale: (default: 7.0)\n");
@@ -244,15 +275,23 @@ void print_usage(int argc, const char* argv[]) {
     printf("  --sampling-method {euler, euler_a, heun, dpm2, dpm++2s_a, dpm++2m, dpm++2mv2, ipndm, ipndm_v, lcm, ddim_trailing, tcd}\n");
     printf("                                     sampling method (default: \"euler_a\")\n");
     printf("  --steps  STEPS                     number of sample steps (default: 20)\n");
+    printf("  --sampler-on-backend               keep the latent and the sampler state in VRAM between steps\n");
+    printf("                                     (euler, euler_a, dpm++2m without control net)\n");
     printf("  --rng {std_default, cuda}          RNG (default: cuda)\n");
     printf("  -s SEED, --seed SEED               RNG seed (default: 42, use random seed for < 0)\n");
     printf("  -b, --batch-count COUNT            number of images to generate\n");
+    printf("  --batch-sampling                   denoise all images of a batch in a single graph per step (UNet models only)\n");
+    printf("  --fused-cfg                        evaluate cond and uncond in a single graph per step (UNet models only)\n");
     printf("  --schedule {discrete, karras, exponential, ays, gits} Denoiser sigma schedule (default: discrete)\n");
     printf("  --clip-skip N                      ignore last layers of CLIP network; 1 ignores none, 2 ignores one layer (default: -1)\n");
     printf("                                     <= 0 represents unspecified, will be 1 for SD1.x, 2 for SD2.x\n");
     printf("  --vae-tiling                       process vae in tiles to reduce memory usage\n");
+    printf("  --tile-batch N                     number of tiles computed together by tiled vae and upscaler (default: 1)\n");
     printf("  --vae-on-cpu                       keep vae in cpu (for low vram)\n");
     printf("  --clip-on-cpu                      keep clip in cpu (for low vram)\n");
+    printf("  --cond-cache-mb N                  memory for caching the text conditions of recent prompts (default: 0, disabled)\n");
+    printf("  --step-cache-threshold THRESHOLD   reuse the deep features of the last step while the first block output changes\n");
+    printf("                                     less than THRESHOLD (relative, e.g. 0.05 - 0.15) (default: 0, disabled)\n");
     printf("  --diffusion-fa                     use flash attention in the diffusion model (for low vram)\n");
     printf("                                     Might lower quality, since it implies converting k and v to f16.\n");
     printf("                                     This might crash if it is not supported by the backend.\n");
@@ -429,6 +468,22 @@ void parse_args(int argc, const char** argv, SDParams& params) {
                 break;
             }
             params.output_path = argv[i];
+        } else if (arg == "--png-compression") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.png_compression = std::stoi(argv[i]);
+            if (params.png_compression < 0 || params.png_compression > 9) {
+                fprintf(stderr, "error: png compression level must be between 0 and 9\n");
+                exit(1);
+            }
+        } else if (arg == "--profile") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.profile_path = argv[i];
         } else if (arg == "-p" || arg == "--prompt") {
             if (++i >= argc) {
                 invalid_arg = true;
@@ -525,6 +580,32 @@ void parse_args(int argc, const char** argv, SDParams& params) {
             params.diffusion_flash_attn = true;  // can reduce MEM significantly
         } else if (arg == "--canny") {
             params.canny_preprocess = true;
+        } else if (arg == "--batch-sampling") {
+            params.batch_sampling = true;
+        } else if (arg == "--fused-cfg") {
+            params.fused_cfg = true;
+        } else if (arg == "--lora-runtime") {
+            params.lora_runtime = true;
+        } else if (arg == "--sampler-on-backend") {
+            params.sampler_on_backend = true;
+        } else if (arg == "--cond-cache-mb") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.cond_cache_mb = std::stoi(argv[i]);
+        } else if (arg == "--step-cache-threshold") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.step_cache_threshold = std::stof(argv[i]);
+        } else if (arg == "--tile-batch") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.tile_batch = std::stoi(argv[i]);
         } else if (arg == "-b" || arg == "--batch-count") {
             if (++i >= argc) {
                 invalid_arg = true;
@@ -827,6 +908,186 @@ void sd_log_cb(enum sd_log_level_t level, const char* log, void* data) {
     fflush(out_stream);
 }
 
+void sd_profile_cb(const sd_profile_event_t* event, void* data) {
+    // the upscaler reports from its own thread
+    static std::mutex profile_mutex;
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    FILE* out_stream = (FILE*)data;
+    const char* type = "stage";
+    if (event->type == SD_PROFILE_STEP) {
+        type = "step";
+    } else if (event->type == SD_PROFILE_COMPUTE) {
+        type = "compute";
+    }
+    fprintf(out_stream, "{\"type\": \"%s\", \"name\": \"%s\", \"time_us\": %lld", type, event->name, (long long)event->time_us);
+    if (event->type == SD_PROFILE_STEP) {
+        fprintf(out_stream, ", \"step\": %d, \"steps\": %d", event->step, event->steps);
+    } else if (event->type == SD_PROFILE_COMPUTE) {
+        fprintf(out_stream, ", \"build_time_us\": %lld, \"compute_time_us\": %lld, \"params_buffer_size\": %zu, \"compute_buffer_size\": %zu, \"on_device\": %s",
+                (long long)event->build_time_us, (long long)event->compute_time_us,
+                event->params_buffer_size, event->compute_buffer_size, event->on_device ? "true" : "false");
+    }
+    fprintf(out_stream, ", \"peak_host_memory\": %zu, \"peak_device_memory\": %zu}\n", event->peak_host_memory, event->peak_device_memory);
+    fflush(out_stream);
+}
+
+struct ImageQueue {
+    std::deque<std::pair<int, sd_image_t>> images;
+    size_t capacity;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    ImageQueue(size_t capacity)
+        : capacity(capacity) {}
+
+    // blocks while the queue is full
+    void push(int index, sd_image_t image) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return images.size() < capacity; });
+        images.push_back({index, image});
+        cv.notify_all();
+    }
+
+    // returns false once the queue is closed and empty
+    bool pop(int& index, sd_image_t& image) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return !images.empty() || closed; });
+        if (images.empty()) {
+            return false;
+        }
+        index = images.front().first;
+        image = images.front().second;
+        images.pop_front();
+        cv.notify_all();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        cv.notify_all();
+    }
+};
+
+// Upscales and saves the generated images on worker threads while the next ones are sampled.
+// The queues are bounded, a slow upscaler or disk stalls the generation instead of piling up
+// decoded images.
+struct OutputPipeline {
+    const SDParams& params;
+    upscaler_ctx_t* upscaler_ctx;
+    std::string dummy_name;
+    std::string ext;
+    bool is_jpg;
+    int png_threads;
+
+    ImageQueue upscale_queue;
+    ImageQueue write_queue;
+    std::thread upscale_thread;
+    std::vector<std::thread> write_threads;
+
+    OutputPipeline(const SDParams& params, upscaler_ctx_t* upscaler_ctx, int n_writers)
+        : params(params), upscaler_ctx(upscaler_ctx), upscale_queue(1), write_queue(n_writers) {
+        // the writers share the thread budget, sampling keeps running next to them
+        png_threads = std::max(1, params.n_threads / n_writers);
+
+        std::string lc_ext;
+        size_t last      = params.output_path.find_last_of(".");
+        size_t last_path = std::min(params.output_path.find_last_of("/"),
+                                    params.output_path.find_last_of("\\"));
+        if (last != std::string::npos  // filename has extension
+            && (last_path == std::string::npos || last > last_path)) {
+            dummy_name = params.output_path.substr(0, last);
+            ext = lc_ext = params.output_path.substr(last);
+            std::transform(ext.begin(), ext.end(), lc_ext.begin(), ::tolower);
+            is_jpg = lc_ext == ".jpg" || lc_ext == ".jpeg" || lc_ext == ".jpe";
+        } else {
+            dummy_name = params.output_path;
+            ext = lc_ext = "";
+            is_jpg       = false;
+        }
+        // appending ".png" to absent or unknown extension
+        if (!is_jpg && lc_ext != ".png") {
+            dummy_name += ext;
+            ext = ".png";
+        }
+
+        if (upscaler_ctx != NULL) {
+            upscale_thread = std::thread([this]() { upscale_worker(); });
+        }
+        for (int i = 0; i < n_writers; i++) {
+            write_threads.emplace_back([this]() { write_worker(); });
+        }
+    }
+
+    ~OutputPipeline() {
+        finish();
+    }
+
+    void push(int index, sd_image_t image) {
+        if (upscaler_ctx != NULL) {
+            upscale_queue.push(index, image);
+        } else {
+            write_queue.push(index, image);
+        }
+    }
+
+    // waits until every pushed image is saved
+    void finish() {
+        upscale_queue.close();
+        if (upscale_thread.joinable()) {
+            upscale_thread.join();
+        }
+        write_queue.close();
+        for (auto& thread : write_threads) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+    }
+
+    void upscale_worker() {
+        int upscale_factor = 4;  // unused for RealESRGAN_x4plus_anime_6B.pth
+        int index;
+        sd_image_t image;
+        while (upscale_queue.pop(index, image)) {
+            for (int u = 0; u < params.upscale_repeats; ++u) {
+                sd_image_t upscaled_image = upscale(upscaler_ctx, image, upscale_factor);
+                if (upscaled_image.data == NULL) {
+                    printf("upscale failed\n");
+                    break;
+                }
+                free(image.data);
+                image = upscaled_image;
+            }
+            write_queue.push(index, image);
+        }
+    }
+
+    void write_worker() {
+        int index;
+        sd_image_t image;
+        while (write_queue.pop(index, image)) {
+            std::string final_image_path = index > 0 ? dummy_name + "_" + std::to_string(index + 1) + ext : dummy_name + ext;
+            if (is_jpg) {
+                stbi_write_jpg(final_image_path.c_str(), image.width, image.height, image.channel,
+                               image.data, 90, get_image_params(params, params.seed + index).c_str());
+                printf("save result JPEG image to '%s'\n", final_image_path.c_str());
+            } else if (write_png(final_image_path, image, get_image_params(params, params.seed + index).c_str(),
+                                 params.png_compression, png_threads)) {
+                printf("save result PNG image to '%s'\n", final_image_path.c_str());
+            } else {
+                fprintf(stderr, "failed to save '%s'\n", final_image_path.c_str());
+            }
+            free(image.data);
+        }
+    }
+};
+
+void sd_image_cb(int index, sd_image_t image, void* data) {
+    ((OutputPipeline*)data)->push(index, image);
+}
+
 int main(int argc, const char* argv[]) {
     SDParams params;
 
@@ -834,6 +1095,15 @@ int main(int argc, const char* argv[]) {
 
     sd_set_log_callback(sd_log_cb, (void*)&params);
 
+    if (params.profile_path.size() > 0) {
+        FILE* profile_file = fopen(params.profile_path.c_str(), "a");
+        if (profile_file == NULL) {
+            fprintf(stderr, "error: can not open profile file %s\n", params.profile_path.c_str());
+            return 1;
+        }
+        sd_set_profile_callback(sd_profile_cb, profile_file);
+    }
+
     if (params.verbose) {
         print_params(params);
         printf("%s", sd_get_system_info());
@@ -975,7 +1245,15 @@ int main(int argc, const char* argv[]) {
                                   params.diffusion_flash_attn,
                                   params.chroma_use_dit_mask,
                                   params.chroma_use_t5_mask,
-                                  params.chroma_t5_mask_pad);
+                                  params.chroma_t5_mask_pad,
+                                  params.batch_sampling,
+                                  params.fused_cfg,
+                                  params.tile_batch,
+                                  0,
+                                  params.lora_runtime,
+                                  params.sampler_on_backend,
+                                  params.cond_cache_mb,
+                                  params.step_cache_threshold);
 
     if (sd_ctx == NULL) {
         printf("new_sd_ctx_t failed\n");
@@ -1018,6 +1296,26 @@ int main(int argc, const char* argv[]) {
                              1,
                              mask_image_buffer};
 
+    upscaler_ctx_t* upscaler_ctx = NULL;
+    auto load_upscaler           = [&]() {
+        if (params.mode != IMG2VID && params.esrgan_path.size() > 0 && params.upscale_repeats > 0) {
+            upscaler_ctx = new_upscaler_ctx(params.esrgan_path.c_str(),
+                                            params.n_threads,
+                                            params.tile_batch);
+            if (upscaler_ctx == NULL) {
+                printf("new_upscaler_ctx failed\n");
+            }
+        }
+    };
+    // the images are upscaled and saved while the next ones are generated. A single image has
+    // nothing to overlap with, the upscaler is then loaded after the generation freed its weights.
+    std::unique_ptr<OutputPipeline> output;
+    if (params.mode != IMG2VID && params.batch_count > 1) {
+        load_upscaler();
+        output.reset(new OutputPipeline(params, upscaler_ctx, std::min(params.batch_count, 4)));
+        sd_set_image_callback(sd_image_cb, output.get());
+    }
+
     sd_image_t* results;
     if (params.mode == TXT2IMG) {
         results = txt2img(sd_ctx,
@@ -1076,9 +1374,13 @@ int main(int argc, const char* argv[]) {
                     continue;
                 }
                 std::string final_image_path = i > 0 ? dummy_name + "_" + std::to_string(i + 1) + ".png" : dummy_name + ".png";
-                stbi_write_png(final_image_path.c_str(), results[i].width, results[i].height, results[i].channel,
-                               results[i].data, 0, get_image_params(params, params.seed + i).c_str());
-                printf("save result image to '%s'\n", final_image_path.c_str());
+                // the frames are written one after the other once sampling is done, each gets every thread
+                if (write_png(final_image_path, results[i], get_image_params(params, params.seed + i).c_str(),
+                              params.png_compression, params.n_threads)) {
+                    printf("save result image to '%s'\n", final_image_path.c_str());
+                } else {
+                    fprintf(stderr, "failed to save '%s'\n", final_image_path.c_str());
+                }
                 free(results[i].data);
                 results[i].data = NULL;
             }
@@ -1141,76 +1443,32 @@ int main(int argc, const char* argv[]) {
                        params.skip_layer_end);
     }
 
+    sd_set_image_callback(NULL, NULL);
+
     if (results == NULL) {
         printf("generate failed\n");
+        output.reset();
+        if (upscaler_ctx != NULL) {
+            free_upscaler_ctx(upscaler_ctx);
+        }
         free_sd_ctx(sd_ctx);
         return 1;
     }
 
-    int upscale_factor = 4;  // unused for RealESRGAN_x4plus_anime_6B.pth
-    if (params.esrgan_path.size() > 0 && params.upscale_repeats > 0) {
-        upscaler_ctx_t* upscaler_ctx = new_upscaler_ctx(params.esrgan_path.c_str(),
-                                                        params.n_threads);
-
-        if (upscaler_ctx == NULL) {
-            printf("new_upscaler_ctx failed\n");
-        } else {
-            for (int i = 0; i < params.batch_count; i++) {
-                if (results[i].data == NULL) {
-                    continue;
-                }
-                sd_image_t current_image = results[i];
-                for (int u = 0; u < params.upscale_repeats; ++u) {
-                    sd_image_t upscaled_image = upscale(upscaler_ctx, current_image, upscale_factor);
-                    if (upscaled_image.data == NULL) {
-                        printf("upscale failed\n");
-                        break;
-                    }
-                    free(current_image.data);
-                    current_image = upscaled_image;
-                }
-                results[i] = current_image;  // Set the final upscaled image as the result
-            }
-        }
-    }
-
-    std::string dummy_name, ext, lc_ext;
-    bool is_jpg;
-    size_t last      = params.output_path.find_last_of(".");
-    size_t last_path = std::min(params.output_path.find_last_of("/"),
-                                params.output_path.find_last_of("\\"));
-    if (last != std::string::npos  // filename has extension
-        && (last_path == std::string::npos || last > last_path)) {
-        dummy_name = params.output_path.substr(0, last);
-        ext = lc_ext = params.output_path.substr(last);
-        std::transform(ext.begin(), ext.end(), lc_ext.begin(), ::tolower);
-        is_jpg = lc_ext == ".jpg" || lc_ext == ".jpeg" || lc_ext == ".jpe";
-    } else {
-        dummy_name = params.output_path;
-        ext = lc_ext = "";
-        is_jpg       = false;
-    }
-    // appending ".png" to absent or unknown extension
-    if (!is_jpg && lc_ext != ".png") {
-        dummy_name += ext;
-        ext = ".png";
+    if (output == NULL) {
+        load_upscaler();
+        output.reset(new OutputPipeline(params, upscaler_ctx, std::max(1, std::min(params.batch_count, 4))));
     }
+    // images that were not handed over while generating
     for (int i = 0; i < params.batch_count; i++) {
-        if (results[i].data == NULL) {
-            continue;
+        if (results[i].data != NULL) {
+            output->push(i, results[i]);
+            results[i].data = NULL;
         }
-        std::string final_image_path = i > 0 ? dummy_name + "_" + std::to_string(i + 1) + ext : dummy_name + ext;
-        if (is_jpg) {
-            stbi_write_jpg(final_image_path.c_str(), results[i].width, results[i].height, results[i].channel,
-                           results[i].data, 90, get_image_params(params, params.seed + i).c_str());
-            printf("save result JPEG image to '%s'\n", final_image_path.c_str());
-        } else {
-            stbi_write_png(final_image_path.c_str(), results[i].width, results[i].height, results[i].channel,
-                           results[i].data, 0, get_image_params(params, params.seed + i).c_str());
-            printf("save result PNG image to '%s'\n", final_image_path.c_str());
-        }
-        free(results[i].data);
-        results[i].data = NULL;
+    }
+    output->finish();
+    if (upscaler_ctx != NULL) {
+        free_upscaler_ctx(upscaler_ctx);
     }
     free(results);
     free_sd_ctx(sd_ctx);
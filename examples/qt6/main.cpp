@@ -65,11 +65,88 @@ struct SDParams {
     bool verbose = false;
 };
 
+// Everything new_sd_ctx() depends on for the jobs we queue. Two jobs with the
+// same key can share one context; anything else needs a reload. The other
+// new_sd_ctx() arguments are fixed, the UI has no controls for them.
+struct SDContextKey {
+    std::string model_path;
+    std::string vae_path;
+    int n_threads = -1;
+
+    explicit SDContextKey(const SDParams& params)
+        : model_path(params.model_path),
+          vae_path(params.vae_path),
+          n_threads(params.n_threads) {}
+
+    bool operator==(const SDContextKey& other) const {
+        return model_path == other.model_path &&
+               vae_path == other.vae_path &&
+               n_threads == other.n_threads;
+    }
+
+    bool operator!=(const SDContextKey& other) const {
+        return !(*this == other);
+    }
+};
+
+// Keeps the last loaded sd_ctx_t alive between jobs so that a queue of
+// generations against the same model only pays for loading it once.
+class SDContextCache {
+public:
+    SDContextCache() = default;
+    SDContextCache(const SDContextCache&) = delete;
+    SDContextCache& operator=(const SDContextCache&) = delete;
+
+    ~SDContextCache() {
+        clear();
+    }
+
+    // Hold this for as long as the context returned by acquire() is in use.
+    QMutex* mutex() {
+        return &mutex_;
+    }
+
+    // Returns the cached context if it was created for the same key,
+    // otherwise frees it and loads a new one. Returns nullptr on failure.
+    sd_ctx_t* acquire(const SDParams& params) {
+        SDContextKey key(params);
+        if (ctx_ != nullptr && key_ == key) {
+            return ctx_;
+        }
+        clear();
+
+        // free_params_immediately must stay off, the weights are reused by the next job,
+        // the last few LoRAs and prompt conditions stay cached for the same reason
+        ctx_ = new_sd_ctx(params.model_path.c_str(), "", "", "", "",
+                          params.vae_path.c_str(), "", "", "", "", "",
+                          true, false, false, params.n_threads,
+                          SD_TYPE_COUNT, CUDA_RNG, DEFAULT,
+                          false, false, false, false, false, false, 0, false, false, 1, 4, false, false, 64, 0.f);
+        if (ctx_ != nullptr) {
+            key_ = key;
+        }
+        return ctx_;
+    }
+
+    void clear() {
+        if (ctx_ != nullptr) {
+            free_sd_ctx(ctx_);
+            ctx_ = nullptr;
+        }
+    }
+
+private:
+    QMutex mutex_;
+    sd_ctx_t* ctx_ = nullptr;
+    SDContextKey key_{SDParams()};
+};
+
 class GenerationWorker : public QThread {
     Q_OBJECT
 
 public:
-    GenerationWorker(const SDParams& params) : params_(params) {}
+    GenerationWorker(const SDParams& params, SDContextCache* ctxCache)
+        : params_(params), ctxCache_(ctxCache) {}
 
 signals:
     void finished(bool success, const QString& message, const QString& imagePath, const QString& arguments);
@@ -86,11 +163,8 @@ protected:
             return;
         }
 
-        sd_ctx_t* sd_ctx = new_sd_ctx(params_.model_path.c_str(), "", "", "", "",
-                                     params_.vae_path.c_str(), "", "", "", "", "",
-                                     true, false, true, params_.n_threads,
-                                     SD_TYPE_COUNT, CUDA_RNG, DEFAULT,
-                                     false, false, false, false, false, false, 0);
+        QMutexLocker locker(ctxCache_->mutex());
+        sd_ctx_t* sd_ctx = ctxCache_->acquire(params_);
 
         if (!sd_ctx) {
             emit finished(false, "Failed to initialize SD context", "", args);
@@ -109,7 +183,6 @@ protected:
             int c = 0, w = 0, h = 0;
             uint8_t* input_buffer = stbi_load(params_.input_path.c_str(), &w, &h, &c, 3);
             if (!input_buffer) {
-                free_sd_ctx(sd_ctx);
                 emit finished(false, "Failed to load input image", "", args);
                 return;
             }
@@ -164,7 +237,6 @@ protected:
         }
         
         if (results) free(results);
-        free_sd_ctx(sd_ctx);
         
         emit finished(success, success ? "Generation completed" : "Generation failed",
                      success ? QString::fromStdString(params_.output_path) : "", args);
@@ -192,6 +264,7 @@ private:
     }
     
     SDParams params_;
+    SDContextCache* ctxCache_;
 };
 
 class MainWindow : public QWidget {
@@ -204,6 +277,15 @@ public:
         loadSettings();
     }
 
+    ~MainWindow() {
+        // the worker renders with ctxCache_, which is destroyed with the window
+        if (currentWorker_ != nullptr) {
+            currentWorker_->wait();
+            delete currentWorker_;
+            currentWorker_ = nullptr;
+        }
+    }
+
 private slots:
     void browseModel() {
         QString file = QFileDialog::getOpenFileName(this, "Select Model", "", "Model Files (*.gguf *.safetensors)");
@@ -304,7 +386,7 @@ private slots:
         jobsProgressLabel_->setVisible(true);
         
         SDParams params = jobQueue_.dequeue();
-        currentWorker_ = new GenerationWorker(params);
+        currentWorker_ = new GenerationWorker(params, &ctxCache_);
         connect(currentWorker_, &GenerationWorker::finished, this, &MainWindow::onGenerationFinished);
         currentWorker_->start();
     }
@@ -587,6 +669,7 @@ private:
     QQueue<SDParams> jobQueue_;
     int completedJobs_ = 0;
     GenerationWorker* currentWorker_ = nullptr;
+    SDContextCache ctxCache_;
     
     void saveImageToSettings(const QString& imagePath, const QString& arguments) {
         qDebug() << "saveImageToSettings: img:" << imagePath << " ;args=" << arguments;
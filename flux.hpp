@@ -873,7 +873,8 @@ namespace Flux {
                                          struct ggml_tensor* guidance,
                                          struct ggml_tensor* pe,
                                          struct ggml_tensor* mod_index_arange = NULL,
-                                         std::vector<int> skip_layers         = {}) {
+                                         std::vector<int> skip_layers         = {},
+                                         StepCache* step_cache                = NULL) {
             auto img_in      = std::dynamic_pointer_cast<Linear>(blocks["img_in"]);
             auto txt_in      = std::dynamic_pointer_cast<Linear>(blocks["txt_in"]);
             auto final_layer = std::dynamic_pointer_cast<LastLayer>(blocks["final_layer"]);
@@ -923,6 +924,8 @@ namespace Flux {
 
             txt = txt_in->forward(ctx, txt);
 
+            struct ggml_tensor* first = NULL;
+            bool cached               = false;
             for (int i = 0; i < params.depth; i++) {
                 if (skip_layers.size() > 0 && std::find(skip_layers.begin(), skip_layers.end(), i) != skip_layers.end()) {
                     continue;
@@ -933,10 +936,26 @@ namespace Flux {
                 auto img_txt = block->forward(ctx, img, txt, vec, pe, txt_img_mask);
                 img          = img_txt.first;   // [N, n_img_token, hidden_size]
                 txt          = img_txt.second;  // [N, n_txt_token, hidden_size]
+
+                if (step_cache != NULL && i == 0) {
+                    auto change = step_cache->first_block(ctx, img);
+                    if (change != NULL) {
+                        return change;
+                    }
+                    if (step_cache->skipping()) {
+                        cached = true;
+                        break;
+                    }
+                    first = ggml_concat(ctx, txt, img, 1);
+                }
             }
 
             auto txt_img = ggml_concat(ctx, txt, img, 1);  // [N, n_txt_token + n_img_token, hidden_size]
-            for (int i = 0; i < params.depth_single_blocks; i++) {
+            if (cached) {
+                // the remaining blocks add the residual of the last full evaluation
+                txt_img = ggml_add(ctx, txt_img, step_cache->saved());
+            }
+            for (int i = 0; i < params.depth_single_blocks && !cached; i++) {
                 if (skip_layers.size() > 0 && std::find(skip_layers.begin(), skip_layers.end(), i + params.depth) != skip_layers.end()) {
                     continue;
                 }
@@ -944,6 +963,9 @@ namespace Flux {
 
                 txt_img = block->forward(ctx, txt_img, vec, pe, txt_img_mask);
             }
+            if (first != NULL) {
+                step_cache->save(ctx, ggml_sub(ctx, txt_img, first));
+            }
 
             txt_img = ggml_cont(ctx, ggml_permute(ctx, txt_img, 0, 2, 1, 3));  // [n_txt_token + n_img_token, N, hidden_size]
             img     = ggml_view_3d(ctx,
@@ -984,7 +1006,8 @@ namespace Flux {
                                     struct ggml_tensor* pe,
                                     struct ggml_tensor* mod_index_arange  = NULL,
                                     std::vector<ggml_tensor*> ref_latents = {},
-                                    std::vector<int> skip_layers          = {}) {
+                                    std::vector<int> skip_layers          = {},
+                                    StepCache* step_cache                 = NULL) {
             // Forward pass of DiT.
             // x: (N, C, H, W) tensor of spatial inputs (images or latent representations of images)
             // timestep: (N,) tensor of diffusion timesteps
@@ -1024,7 +1047,10 @@ namespace Flux {
                 }
             }
 
-            auto out = forward_orig(ctx, img, context, timestep, y, guidance, pe, mod_index_arange, skip_layers);  // [N, num_tokens, C * patch_size * patch_size]
+            auto out = forward_orig(ctx, img, context, timestep, y, guidance, pe, mod_index_arange, skip_layers, step_cache);  // [N, num_tokens, C * patch_size * patch_size]
+            if (step_cache != NULL && step_cache->probing()) {
+                return out;
+            }
             if (out->ne[1] > img_tokens) {
                 out = ggml_cont(ctx, ggml_permute(ctx, out, 0, 2, 1, 3));  // [num_tokens, N, C * patch_size * patch_size]
                 out = ggml_view_3d(ctx, out, out->ne[0], out->ne[1], img_tokens, out->nb[1], out->nb[2], 0);
@@ -1048,6 +1074,8 @@ namespace Flux {
         std::vector<float> mod_index_arange_vec;  // for cache
         SDVersion version;
         bool use_mask = false;
+        StepCache step_cache;
+        RuntimeLoraMap runtime_loras;
 
         FluxRunner(ggml_backend_t backend,
                    std::map<std::string, enum ggml_type>& tensor_types = empty_tensor_types,
@@ -1102,6 +1130,8 @@ namespace Flux {
 
             flux = Flux(flux_params);
             flux.init(params_ctx, tensor_types, prefix);
+            flux.set_runtime_lora_map(&runtime_loras);
+            step_cache.backend = backend;
         }
 
         std::string get_desc() {
@@ -1121,7 +1151,7 @@ namespace Flux {
                                         std::vector<ggml_tensor*> ref_latents = {},
                                         std::vector<int> skip_layers          = {}) {
             GGML_ASSERT(x->ne[3] == 1);
-            struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, FLUX_GRAPH_SIZE, false);
+            struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, get_runtime_lora_graph_size(runtime_loras, FLUX_GRAPH_SIZE), false);
 
             struct ggml_tensor* mod_index_arange = NULL;
 
@@ -1131,8 +1161,6 @@ namespace Flux {
                 c_concat = to_backend(c_concat);
             }
             if (flux_params.is_chroma) {
-                guidance = ggml_set_f32(guidance, 0);
-
                 if (!use_mask) {
                     y = NULL;
                 }
@@ -1171,8 +1199,10 @@ namespace Flux {
                                                    pe,
                                                    mod_index_arange,
                                                    ref_latents,
-                                                   skip_layers);
+                                                   skip_layers,
+                                                   &step_cache);
 
+            step_cache.expand(gf);
             ggml_build_forward_expand(gf, out);
 
             return gf;
@@ -1198,7 +1228,20 @@ namespace Flux {
                 return build_graph(x, timesteps, context, c_concat, y, guidance, ref_latents, skip_layers);
             };
 
-            GGMLRunner::compute(get_graph, n_threads, false, output, output_ctx);
+            if (flux_params.is_chroma) {
+                guidance = ggml_set_f32(guidance, 0);
+            }
+
+            std::string key = "flux:";
+            for (int layer : skip_layers) {
+                key += std::to_string(layer) + ",";
+            }
+            std::vector<struct ggml_tensor*> inputs = {x, timesteps, context, c_concat, y, guidance};
+            inputs.insert(inputs.end(), ref_latents.begin(), ref_latents.end());
+            auto run = [&](struct ggml_tensor** out, struct ggml_context* out_ctx) {
+                GGMLRunner::compute_cached(get_graph, inputs, key + step_cache.graph_key(), n_threads, out, out_ctx);
+            };
+            step_cache.evaluate(context, skip_layers.empty(), run, output, output_ctx);
         }
 
         void test() {
@@ -5,18 +5,22 @@
 #include <inttypes.h>
 #include <stdarg.h>
 #include <algorithm>
+#include <condition_variable>
 #include <cstring>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <iterator>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <random>
 #include <regex>
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -125,7 +129,11 @@ __STATIC_INLINE__ void ggml_log_callback_default(ggml_log_level level, const cha
 }
 
 __STATIC_INLINE__ void ggml_tensor_set_f32_randn(struct ggml_tensor* tensor, std::shared_ptr<RNG> rng) {
-    uint32_t n                        = (uint32_t)ggml_nelements(tensor);
+    uint32_t n = (uint32_t)ggml_nelements(tensor);
+    if (tensor->type == GGML_TYPE_F32 && ggml_is_contiguous(tensor)) {
+        rng->randn((float*)tensor->data, n);
+        return;
+    }
     std::vector<float> random_numbers = rng->randn(n);
     for (uint32_t i = 0; i < n; i++) {
         ggml_set_f32_1d(tensor, i, random_numbers[i]);
@@ -295,124 +303,150 @@ __STATIC_INLINE__ void copy_ggml_tensor(struct ggml_tensor* dst, struct ggml_ten
     ggml_free(ctx);
 }
 
+// data of the tensor lives in a non host backend buffer
+__STATIC_INLINE__ bool ggml_tensor_is_on_device(struct ggml_tensor* tensor) {
+    return tensor->buffer != NULL && !ggml_backend_buffer_is_host(tensor->buffer);
+}
+
 __STATIC_INLINE__ float sigmoid(float x) {
     return 1 / (1.0f + expf(-x));
 }
 
-// SPECIAL OPERATIONS WITH TENSORS
+// rows handed to each thread by the image conversions, ~64k pixels
+__STATIC_INLINE__ int64_t sd_image_rows_per_thread(int64_t width) {
+    return std::max((int64_t)1, 65536 / std::max((int64_t)1, width));
+}
 
-__STATIC_INLINE__ uint8_t* sd_tensor_to_image(struct ggml_tensor* input) {
-    int64_t width    = input->ne[0];
-    int64_t height   = input->ne[1];
-    int64_t channels = input->ne[2];
-    GGML_ASSERT(channels == 3 && input->type == GGML_TYPE_F32);
-    uint8_t* image_data = (uint8_t*)malloc(width * height * channels);
-    for (int iy = 0; iy < height; iy++) {
-        for (int ix = 0; ix < width; ix++) {
-            for (int k = 0; k < channels; k++) {
-                float value                                               = ggml_tensor_get_f32(input, ix, iy, k);
-                *(image_data + iy * width * channels + ix * channels + k) = (uint8_t)(value * 255.0f);
+// interleaved [height, width, channels] u8 -> planar [channels, height, width] f32,
+// value / divisor, then (value - mean[c]) / std[c] when given
+__STATIC_INLINE__ void sd_u8_to_planar_f32(const uint8_t* src,
+                                           float* dst,
+                                           int64_t width,
+                                           int64_t height,
+                                           int64_t channels,
+                                           float divisor,
+                                           const float* mean = NULL,
+                                           const float* std  = NULL,
+                                           int n_threads     = 0) {
+    sd_parallel_for(n_threads, height, sd_image_rows_per_thread(width), [&](int64_t begin, int64_t end) {
+        for (int64_t iy = begin; iy < end; iy++) {
+            const uint8_t* row = src + iy * width * channels;
+            for (int64_t k = 0; k < channels; k++) {
+                float* plane = dst + (k * height + iy) * width;
+                for (int64_t ix = 0; ix < width; ix++) {
+                    plane[ix] = row[ix * channels + k] / divisor;
+                }
+                if (mean != NULL && std != NULL) {
+                    for (int64_t ix = 0; ix < width; ix++) {
+                        plane[ix] = (plane[ix] - mean[k]) / std[k];
+                    }
+                }
             }
         }
-    }
-    return image_data;
+    });
 }
 
-__STATIC_INLINE__ uint8_t* sd_tensor_to_mul_image(struct ggml_tensor* input, int idx) {
+// planar [channels, height, width] f32 in [0, 1] -> interleaved [height, width, channels] u8,
+// clamped and rounded
+__STATIC_INLINE__ void sd_planar_f32_to_u8(const float* src,
+                                           uint8_t* dst,
+                                           int64_t width,
+                                           int64_t height,
+                                           int64_t channels,
+                                           int n_threads = 0) {
+    sd_parallel_for(n_threads, height, sd_image_rows_per_thread(width), [&](int64_t begin, int64_t end) {
+        for (int64_t iy = begin; iy < end; iy++) {
+            uint8_t* row = dst + iy * width * channels;
+            for (int64_t k = 0; k < channels; k++) {
+                const float* plane = src + (k * height + iy) * width;
+                for (int64_t ix = 0; ix < width; ix++) {
+                    float value            = std::min(std::max(plane[ix] * 255.0f, 0.0f), 255.0f);
+                    row[ix * channels + k] = (uint8_t)(value + 0.5f);
+                }
+            }
+        }
+    });
+}
+
+// SPECIAL OPERATIONS WITH TENSORS
+
+__STATIC_INLINE__ uint8_t* sd_tensor_to_mul_image(struct ggml_tensor* input, int idx, int n_threads = 0) {
     int64_t width    = input->ne[0];
     int64_t height   = input->ne[1];
     int64_t channels = input->ne[2];
-    GGML_ASSERT(channels == 3 && input->type == GGML_TYPE_F32);
+    GGML_ASSERT(channels == 3 && input->type == GGML_TYPE_F32 && ggml_is_contiguous(input));
     uint8_t* image_data = (uint8_t*)malloc(width * height * channels);
-    for (int iy = 0; iy < height; iy++) {
-        for (int ix = 0; ix < width; ix++) {
-            for (int k = 0; k < channels; k++) {
-                float value                                               = ggml_tensor_get_f32(input, ix, iy, k, idx);
-                *(image_data + iy * width * channels + ix * channels + k) = (uint8_t)(value * 255.0f);
-            }
-        }
-    }
+    sd_planar_f32_to_u8((const float*)input->data + idx * width * height * channels, image_data, width, height, channels, n_threads);
     return image_data;
 }
 
+__STATIC_INLINE__ uint8_t* sd_tensor_to_image(struct ggml_tensor* input, int n_threads = 0) {
+    return sd_tensor_to_mul_image(input, 0, n_threads);
+}
+
 __STATIC_INLINE__ void sd_image_to_tensor(const uint8_t* image_data,
                                           struct ggml_tensor* output,
-                                          bool scale = true) {
+                                          bool scale    = true,
+                                          int n_threads = 0) {
     int64_t width    = output->ne[0];
     int64_t height   = output->ne[1];
     int64_t channels = output->ne[2];
-    GGML_ASSERT(channels == 3 && output->type == GGML_TYPE_F32);
-    for (int iy = 0; iy < height; iy++) {
-        for (int ix = 0; ix < width; ix++) {
-            for (int k = 0; k < channels; k++) {
-                float value = *(image_data + iy * width * channels + ix * channels + k);
-                if (scale) {
-                    value /= 255.f;
-                }
-                ggml_tensor_set_f32(output, value, ix, iy, k);
-            }
-        }
-    }
+    GGML_ASSERT(channels == 3 && output->type == GGML_TYPE_F32 && ggml_is_contiguous(output));
+    sd_u8_to_planar_f32(image_data, (float*)output->data, width, height, channels, scale ? 255.f : 1.f, NULL, NULL, n_threads);
 }
 
 __STATIC_INLINE__ void sd_mask_to_tensor(const uint8_t* image_data,
                                          struct ggml_tensor* output,
-                                         bool scale = true) {
+                                         bool scale    = true,
+                                         int n_threads = 0) {
     int64_t width    = output->ne[0];
     int64_t height   = output->ne[1];
     int64_t channels = output->ne[2];
-    GGML_ASSERT(channels == 1 && output->type == GGML_TYPE_F32);
-    for (int iy = 0; iy < height; iy++) {
-        for (int ix = 0; ix < width; ix++) {
-            float value = *(image_data + iy * width * channels + ix);
-            if (scale) {
-                value /= 255.f;
-            }
-            ggml_tensor_set_f32(output, value, ix, iy);
-        }
-    }
+    GGML_ASSERT(channels == 1 && output->type == GGML_TYPE_F32 && ggml_is_contiguous(output));
+    sd_u8_to_planar_f32(image_data, (float*)output->data, width, height, channels, scale ? 255.f : 1.f, NULL, NULL, n_threads);
 }
 
 __STATIC_INLINE__ void sd_apply_mask(struct ggml_tensor* image_data,
                                      struct ggml_tensor* mask,
-                                     struct ggml_tensor* output) {
+                                     struct ggml_tensor* output,
+                                     int n_threads = 0) {
     int64_t width    = output->ne[0];
     int64_t height   = output->ne[1];
     int64_t channels = output->ne[2];
-    GGML_ASSERT(output->type == GGML_TYPE_F32);
-    for (int ix = 0; ix < width; ix++) {
-        for (int iy = 0; iy < height; iy++) {
-            float m = ggml_tensor_get_f32(mask, ix, iy);
-            m       = round(m);  // inpaint models need binary masks
-            ggml_tensor_set_f32(mask, m, ix, iy);
-            for (int k = 0; k < channels; k++) {
-                float value = (1 - m) * (ggml_tensor_get_f32(image_data, ix, iy, k) - .5) + .5;
-                ggml_tensor_set_f32(output, value, ix, iy, k);
+    GGML_ASSERT(output->type == GGML_TYPE_F32 && image_data->type == GGML_TYPE_F32 && mask->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_is_contiguous(output) && ggml_is_contiguous(image_data) && ggml_is_contiguous(mask));
+    GGML_ASSERT(mask->ne[0] == width && mask->ne[1] == height);
+    float* mask_data = (float*)mask->data;
+    const float* src = (const float*)image_data->data;
+    float* dst       = (float*)output->data;
+    sd_parallel_for(n_threads, height, sd_image_rows_per_thread(width), [&](int64_t begin, int64_t end) {
+        for (int64_t iy = begin; iy < end; iy++) {
+            float* m = mask_data + iy * width;
+            for (int64_t ix = 0; ix < width; ix++) {
+                m[ix] = roundf(m[ix]);  // inpaint models need binary masks
+            }
+            for (int64_t k = 0; k < channels; k++) {
+                int64_t offset = (k * height + iy) * width;
+                for (int64_t ix = 0; ix < width; ix++) {
+                    dst[offset + ix] = (float)((1 - m[ix]) * (src[offset + ix] - .5) + .5);
+                }
             }
         }
-    }
+    });
 }
 
 __STATIC_INLINE__ void sd_mul_images_to_tensor(const uint8_t* image_data,
                                                struct ggml_tensor* output,
                                                int idx,
-                                               float* mean = NULL,
-                                               float* std  = NULL) {
+                                               float* mean   = NULL,
+                                               float* std    = NULL,
+                                               int n_threads = 0) {
     int64_t width    = output->ne[0];
     int64_t height   = output->ne[1];
     int64_t channels = output->ne[2];
-    GGML_ASSERT(channels == 3 && output->type == GGML_TYPE_F32);
-    for (int iy = 0; iy < height; iy++) {
-        for (int ix = 0; ix < width; ix++) {
-            for (int k = 0; k < channels; k++) {
-                int value       = *(image_data + iy * width * channels + ix * channels + k);
-                float pixel_val = value / 255.0f;
-                if (mean != NULL && std != NULL)
-                    pixel_val = (pixel_val - mean[k]) / std[k];
-                ggml_tensor_set_f32(output, pixel_val, ix, iy, k, idx);
-            }
-        }
-    }
+    GGML_ASSERT(channels == 3 && output->type == GGML_TYPE_F32 && ggml_is_contiguous(output));
+    float* dst = (float*)output->data + idx * width * height * channels;
+    sd_u8_to_planar_f32(image_data, dst, width, height, channels, 255.0f, mean, std, n_threads);
 }
 
 __STATIC_INLINE__ void sd_image_f32_to_tensor(const float* image_data,
@@ -435,10 +469,12 @@ __STATIC_INLINE__ void sd_image_f32_to_tensor(const float* image_data,
     }
 }
 
+// output_n: index of the tile in the batch of output
 __STATIC_INLINE__ void ggml_split_tensor_2d(struct ggml_tensor* input,
                                             struct ggml_tensor* output,
                                             int x,
-                                            int y) {
+                                            int y,
+                                            int output_n = 0) {
     int64_t width    = output->ne[0];
     int64_t height   = output->ne[1];
     int64_t channels = output->ne[2];
@@ -447,7 +483,7 @@ __STATIC_INLINE__ void ggml_split_tensor_2d(struct ggml_tensor* input,
         for (int ix = 0; ix < width; ix++) {
             for (int k = 0; k < channels; k++) {
                 float value = ggml_tensor_get_f32(input, ix + x, iy + y, k);
-                ggml_tensor_set_f32(output, value, ix, iy, k);
+                ggml_tensor_set_f32(output, value, ix, iy, k, output_n);
             }
         }
     }
@@ -459,11 +495,13 @@ __STATIC_INLINE__ float ggml_smootherstep_f32(const float x) {
     return x * x * x * (x * (6.0f * x - 15.0f) + 10.0f);
 }
 
+// input_n: index of the tile in the batch of input
 __STATIC_INLINE__ void ggml_merge_tensor_2d(struct ggml_tensor* input,
                                             struct ggml_tensor* output,
                                             int x,
                                             int y,
-                                            int overlap) {
+                                            int overlap,
+                                            int input_n = 0) {
     int64_t width    = input->ne[0];
     int64_t height   = input->ne[1];
     int64_t channels = input->ne[2];
@@ -475,7 +513,7 @@ __STATIC_INLINE__ void ggml_merge_tensor_2d(struct ggml_tensor* input,
     for (int iy = 0; iy < height; iy++) {
         for (int ix = 0; ix < width; ix++) {
             for (int k = 0; k < channels; k++) {
-                float new_value = ggml_tensor_get_f32(input, ix, iy, k);
+                float new_value = ggml_tensor_get_f32(input, ix, iy, k, input_n);
                 if (overlap > 0) {  // blend colors in overlapped area
                     float old_value = ggml_tensor_get_f32(output, x + ix, y + iy, k);
 
@@ -573,6 +611,35 @@ __STATIC_INLINE__ struct ggml_tensor* ggml_tensor_concat(struct ggml_context* ct
     return result;
 }
 
+// stack n copies of a followed by n copies of b along the batch dim
+// a, b: batch dim of size 1 or n, it has to be the outermost dim
+// result: batch dim of size 2 * n
+__STATIC_INLINE__ struct ggml_tensor* ggml_tensor_stack_batch(struct ggml_context* ctx,
+                                                              struct ggml_tensor* a,
+                                                              struct ggml_tensor* b,
+                                                              int64_t n,
+                                                              int dim) {
+    GGML_ASSERT(a->type == GGML_TYPE_F32 && b->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_is_contiguous(a) && ggml_is_contiguous(b));
+    GGML_ASSERT(a->ne[dim] == 1 || a->ne[dim] == n);
+    GGML_ASSERT(b->ne[dim] == 1 || b->ne[dim] == n);
+    for (int d = 0; d < GGML_MAX_DIMS; ++d) {
+        GGML_ASSERT(d <= dim || (a->ne[d] == 1 && b->ne[d] == 1));
+        GGML_ASSERT(d == dim || a->ne[d] == b->ne[d]);
+    }
+    int64_t ne[GGML_MAX_DIMS] = {a->ne[0], a->ne[1], a->ne[2], a->ne[3]};
+    ne[dim]                   = 2 * n;
+
+    struct ggml_tensor* result = ggml_new_tensor(ctx, GGML_TYPE_F32, GGML_MAX_DIMS, ne);
+    size_t item_size           = ggml_nbytes(a) / a->ne[dim];
+    char* dst                  = (char*)result->data;
+    for (int64_t i = 0; i < n; i++) {
+        memcpy(dst + i * item_size, (char*)a->data + (a->ne[dim] == 1 ? 0 : i) * item_size, item_size);
+        memcpy(dst + (n + i) * item_size, (char*)b->data + (b->ne[dim] == 1 ? 0 : i) * item_size, item_size);
+    }
+    return result;
+}
+
 // convert values from [0, 1] to [-1, 1]
 __STATIC_INLINE__ void ggml_tensor_scale_input(struct ggml_tensor* src) {
     int64_t nelements = ggml_nelements(src);
@@ -596,20 +663,58 @@ __STATIC_INLINE__ void ggml_tensor_scale_output(struct ggml_tensor* src) {
 typedef std::function<void(ggml_tensor*, ggml_tensor*, bool)> on_tile_process;
 
 // Tiling
-__STATIC_INLINE__ void sd_tiling(ggml_tensor* input, ggml_tensor* output, const int scale, const int tile_size, const float tile_overlap_factor, on_tile_process on_processing) {
+// tile_size is in input units, scale is output/input size (< 1 when encoding)
+// tile_batch tiles are stacked in ne[3] and processed in one call of on_processing,
+// splitting/merging of the neighbouring batches overlaps with it
+__STATIC_INLINE__ void sd_tiling(ggml_tensor* input, ggml_tensor* output, const float scale, int tile_size, const float tile_overlap_factor, on_tile_process on_processing, int tile_batch = 1) {
     int input_width   = (int)input->ne[0];
     int input_height  = (int)input->ne[1];
     int output_width  = (int)output->ne[0];
     int output_height = (int)output->ne[1];
     GGML_ASSERT(input_width % 2 == 0 && input_height % 2 == 0 && output_width % 2 == 0 && output_height % 2 == 0);  // should be multiple of 2
 
+    // inputs smaller than a tile are processed in tiles as large as their smaller side
+    tile_size            = std::min(tile_size, std::min(input_width, input_height));
     int tile_overlap     = (int32_t)(tile_size * tile_overlap_factor);
     int non_tile_overlap = tile_size - tile_overlap;
+    int out_tile_size    = (int)(tile_size * scale);
+    GGML_ASSERT(out_tile_size == tile_size * scale);
+
+    auto to_output = [&](int v) {
+        int out = (int)(v * scale);
+        GGML_ASSERT(out == v * scale);  // tiles have to start on an output pixel
+        return out;
+    };
+
+    std::vector<std::pair<int, int>> tiles;
+    bool last_y = false, last_x = false;
+    for (int y = 0; y < input_height && !last_y; y += non_tile_overlap) {
+        if (y + tile_size >= input_height) {
+            y      = input_height - tile_size;
+            last_y = true;
+        }
+        for (int x = 0; x < input_width && !last_x; x += non_tile_overlap) {
+            if (x + tile_size >= input_width) {
+                x      = input_width - tile_size;
+                last_x = true;
+            }
+            tiles.push_back({x, y});
+        }
+        last_x = false;
+    }
+    int num_tiles = (int)tiles.size();
+    tile_batch    = std::max(1, std::min(tile_batch, num_tiles));
+    int num_full  = num_tiles / tile_batch;
+    int tail_size = num_tiles % tile_batch;
+
+    size_t input_tile_size  = tile_size * tile_size * input->ne[2] * sizeof(float);
+    size_t output_tile_size = out_tile_size * out_tile_size * output->ne[2] * sizeof(float);
+    int num_slots           = tile_batch * (num_full > 1 ? 2 : 1) + tail_size;
 
     struct ggml_init_params params = {};
-    params.mem_size += tile_size * tile_size * input->ne[2] * sizeof(float);                       // input chunk
-    params.mem_size += (tile_size * scale) * (tile_size * scale) * output->ne[2] * sizeof(float);  // output chunk
-    params.mem_size += 3 * ggml_tensor_overhead();
+    params.mem_size += num_slots * input_tile_size;   // input chunks
+    params.mem_size += num_slots * output_tile_size;  // output chunks
+    params.mem_size += 7 * ggml_tensor_overhead();
     params.mem_buffer = NULL;
     params.no_alloc   = false;
 
@@ -622,40 +727,87 @@ __STATIC_INLINE__ void sd_tiling(ggml_tensor* input, ggml_tensor* output, const
         return;
     }
 
-    // tiling
-    ggml_tensor* input_tile  = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, tile_size, tile_size, input->ne[2], 1);
-    ggml_tensor* output_tile = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, tile_size * scale, tile_size * scale, output->ne[2], 1);
-    on_processing(input_tile, NULL, true);
-    int num_tiles = ceil((float)input_width / non_tile_overlap) * ceil((float)input_height / non_tile_overlap);
+    // tiling, full batches alternate between two buffers, the last partial batch has its own
+    ggml_tensor* input_tiles[3]  = {NULL, NULL, NULL};
+    ggml_tensor* output_tiles[3] = {NULL, NULL, NULL};
+    for (int i = 0; i < 3; i++) {
+        int n = i < 2 ? tile_batch : tail_size;
+        if (n == 0 || (i == 1 && num_full < 2)) {
+            continue;
+        }
+        input_tiles[i]  = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, tile_size, tile_size, input->ne[2], n);
+        output_tiles[i] = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, out_tile_size, out_tile_size, output->ne[2], n);
+    }
+    int num_batches = num_full + (tail_size > 0 ? 1 : 0);
+    auto batch_slot = [&](int b) {
+        return b < num_full ? b % 2 : 2;
+    };
+    auto split_batch = [&](int b) {
+        for (int i = b * tile_batch; i < std::min((b + 1) * tile_batch, num_tiles); i++) {
+            ggml_split_tensor_2d(input, input_tiles[batch_slot(b)], tiles[i].first, tiles[i].second, i - b * tile_batch);
+        }
+    };
+    auto merge_batch = [&](int b) {
+        for (int i = b * tile_batch; i < std::min((b + 1) * tile_batch, num_tiles); i++) {
+            ggml_merge_tensor_2d(output_tiles[batch_slot(b)], output, to_output(tiles[i].first), to_output(tiles[i].second), to_output(tile_overlap), i - b * tile_batch);
+        }
+    };
+
+    on_processing(input_tiles[batch_slot(0)], NULL, true);
     LOG_INFO("processing %i tiles", num_tiles);
     pretty_progress(1, num_tiles, 0.0f);
-    int tile_count = 1;
-    bool last_y = false, last_x = false;
     float last_time = 0.0f;
-    for (int y = 0; y < input_height && !last_y; y += non_tile_overlap) {
-        if (y + tile_size >= input_height) {
-            y      = input_height - tile_size;
-            last_y = true;
-        }
-        for (int x = 0; x < input_width && !last_x; x += non_tile_overlap) {
-            if (x + tile_size >= input_width) {
-                x      = input_width - tile_size;
-                last_x = true;
+    split_batch(0);
+
+    // one worker merges the previous batch and splits the next one while a batch is computed
+    std::mutex io_mutex;
+    std::condition_variable io_cv;
+    int io_started = -1;  // batch being computed
+    int io_done    = -1;  // last batch whose neighbours are merged and split
+    std::thread io_thread;
+    if (num_batches > 1) {
+        io_thread = std::thread([&]() {
+            for (int b = 0; b < num_batches; b++) {
+                {
+                    std::unique_lock<std::mutex> lock(io_mutex);
+                    io_cv.wait(lock, [&]() { return io_started >= b; });
+                }
+                if (b > 0) {
+                    merge_batch(b - 1);
+                }
+                if (b + 1 < num_batches) {
+                    split_batch(b + 1);
+                }
+                {
+                    std::lock_guard<std::mutex> lock(io_mutex);
+                    io_done = b;
+                }
+                io_cv.notify_all();
             }
-            int64_t t1 = ggml_time_ms();
-            ggml_split_tensor_2d(input, input_tile, x, y);
-            on_processing(input_tile, output_tile, false);
-            ggml_merge_tensor_2d(output_tile, output, x * scale, y * scale, tile_overlap * scale);
-            int64_t t2 = ggml_time_ms();
-            last_time  = (t2 - t1) / 1000.0f;
-            pretty_progress(tile_count, num_tiles, last_time);
-            tile_count++;
+        });
+    }
+    for (int b = 0; b < num_batches; b++) {
+        int64_t t1 = ggml_time_ms();
+        if (io_thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(io_mutex);
+                io_started = b;
+            }
+            io_cv.notify_all();
         }
-        last_x = false;
+        on_processing(input_tiles[batch_slot(b)], output_tiles[batch_slot(b)], false);
+        if (io_thread.joinable()) {
+            std::unique_lock<std::mutex> lock(io_mutex);
+            io_cv.wait(lock, [&]() { return io_done >= b; });
+        }
+        int64_t t2 = ggml_time_ms();
+        last_time  = (t2 - t1) / 1000.0f;
+        pretty_progress(std::min((b + 1) * tile_batch, num_tiles), num_tiles, last_time);
     }
-    if (tile_count < num_tiles) {
-        pretty_progress(num_tiles, num_tiles, last_time);
+    if (io_thread.joinable()) {
+        io_thread.join();
     }
+    merge_batch(num_batches - 1);
     ggml_free(tiles_ctx);
 }
 
@@ -1081,7 +1233,29 @@ protected:
 
     std::map<struct ggml_tensor*, const void*> backend_tensor_data_map;
 
+    // graphs kept alive by compute_cached(), keyed by the graph key. Each one keeps the context it
+    // was built in, they are all allocated in the compute buffer and only read their inputs
+    struct CachedGraph {
+        struct ggml_context* ctx  = NULL;
+        struct ggml_cgraph* graph = NULL;
+        std::vector<struct ggml_tensor*> inputs;
+        // copies of the data given to set_backend_tensor_data() while building, the buffers of
+        // the caller are usually reused or freed by the time the graph runs again
+        std::map<struct ggml_tensor*, std::vector<uint8_t>> backend_tensor_data;
+        uint64_t last_use = 0;
+    };
+    std::map<std::string, CachedGraph> cached_graphs;
+    size_t max_cached_graphs   = 8;
+    uint64_t cached_graph_uses = 0;
+    // inputs of the graph compute_cached() is building
+    std::vector<struct ggml_tensor*> graph_inputs;
+    std::vector<struct ggml_tensor*> cached_graph_inputs;
+
     ggml_backend_t backend = NULL;
+    bool on_device         = false;
+
+    // params and compute buffers reported to sd_track_device_memory()
+    size_t tracked_buffer_size = 0;
 
     void alloc_params_ctx() {
         struct ggml_init_params params;
@@ -1117,6 +1291,54 @@ protected:
         }
     }
 
+    void free_cached_graphs() {
+        for (auto& kv : cached_graphs) {
+            ggml_free(kv.second.ctx);
+        }
+        cached_graphs.clear();
+    }
+
+    void evict_cached_graph() {
+        auto lru = cached_graphs.begin();
+        for (auto it = cached_graphs.begin(); it != cached_graphs.end(); it++) {
+            if (it->second.last_use < lru->second.last_use) {
+                lru = it;
+            }
+        }
+        if (lru != cached_graphs.end()) {
+            ggml_free(lru->second.ctx);
+            cached_graphs.erase(lru);
+        }
+    }
+
+    // allocates gf in the compute buffer, which only grows. When it does, the cached graphs
+    // point into the freed buffer and are dropped.
+    bool alloc_graph(struct ggml_cgraph* gf) {
+        size_t buffer_size = get_compute_buffer_size();
+        if (!ggml_gallocr_reserve(compute_allocr, gf)) {
+            LOG_ERROR("%s: failed to allocate the compute buffer\n", get_desc().c_str());
+            return false;
+        }
+        if (get_compute_buffer_size() != buffer_size) {
+            free_cached_graphs();
+        }
+        if (!ggml_gallocr_alloc_graph(compute_allocr, gf)) {
+            return false;
+        }
+        track_buffer_size();
+        return true;
+    }
+
+    static std::string get_graph_input_key(struct ggml_tensor* tensor) {
+        if (tensor == NULL) {
+            return "[]";
+        }
+        char buf[128];
+        snprintf(buf, sizeof(buf), "[%d,%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 "]",
+                 (int)tensor->type, tensor->ne[0], tensor->ne[1], tensor->ne[2], tensor->ne[3]);
+        return buf;
+    }
+
     bool alloc_compute_buffer(get_graph_cb_t get_graph) {
         if (compute_allocr != NULL) {
             return true;
@@ -1132,6 +1354,7 @@ protected:
             free_compute_buffer();
             return false;
         }
+        track_buffer_size();
 
         // compute the required memory
         size_t compute_buffer_size = ggml_gallocr_get_buffer_size(compute_allocr, 0);
@@ -1146,6 +1369,9 @@ protected:
         for (auto& kv : backend_tensor_data_map) {
             auto tensor = kv.first;
             auto data   = kv.second;
+            if (tensor->buffer == NULL) {
+                continue;
+            }
 
             ggml_backend_tensor_set(tensor, data, 0, ggml_nbytes(tensor));
         }
@@ -1153,11 +1379,37 @@ protected:
         backend_tensor_data_map.clear();
     }
 
+    void track_buffer_size() {
+        if (!on_device) {
+            return;
+        }
+        size_t size = get_params_buffer_size() + get_compute_buffer_size();
+        sd_track_device_memory((int64_t)size - (int64_t)tracked_buffer_size);
+        tracked_buffer_size = size;
+    }
+
+    void report_compute(int64_t t0, int64_t t1, int64_t t2) {
+        if (!sd_profile_enabled()) {
+            return;
+        }
+        std::string desc          = get_desc();
+        sd_profile_event_t event  = {};
+        event.type                = SD_PROFILE_COMPUTE;
+        event.name                = desc.c_str();
+        event.time_us             = t2 - t0;
+        event.build_time_us       = t1 - t0;
+        event.compute_time_us     = t2 - t1;
+        event.params_buffer_size  = get_params_buffer_size();
+        event.compute_buffer_size = get_compute_buffer_size();
+        event.on_device           = on_device;
+        sd_profile_report(event);
+    }
+
 public:
     virtual std::string get_desc() = 0;
 
     GGMLRunner(ggml_backend_t backend)
-        : backend(backend) {
+        : backend(backend), on_device(!ggml_backend_is_cpu(backend)) {
         alloc_params_ctx();
     }
 
@@ -1182,6 +1434,7 @@ public:
                       num_tensors);
             return false;
         }
+        track_buffer_size();
         size_t params_buffer_size = ggml_backend_buffer_get_size(params_buffer);
         LOG_DEBUG("%s params backend buffer size = % 6.2f MB(%s) (%i tensors)",
                   get_desc().c_str(),
@@ -1200,6 +1453,7 @@ public:
         if (params_buffer != NULL) {
             ggml_backend_buffer_free(params_buffer);
             params_buffer = NULL;
+            track_buffer_size();
         }
     }
 
@@ -1210,10 +1464,19 @@ public:
         return 0;
     }
 
+    size_t get_compute_buffer_size() {
+        if (compute_allocr != NULL) {
+            return ggml_gallocr_get_buffer_size(compute_allocr, 0);
+        }
+        return 0;
+    }
+
     void free_compute_buffer() {
+        free_cached_graphs();
         if (compute_allocr != NULL) {
             ggml_gallocr_free(compute_allocr);
             compute_allocr = NULL;
+            track_buffer_size();
         }
     }
 
@@ -1227,6 +1490,15 @@ public:
         if (tensor == NULL) {
             return NULL;
         }
+        // inputs of a cached graph always get their own graph tensor, their data is uploaded on every compute
+        for (size_t i = 0; i < graph_inputs.size() && i < cached_graph_inputs.size(); i++) {
+            if (graph_inputs[i] == tensor) {
+                if (cached_graph_inputs[i] == NULL) {
+                    cached_graph_inputs[i] = ggml_dup_tensor(compute_ctx, tensor);
+                }
+                return cached_graph_inputs[i];
+            }
+        }
         // it's performing a compute, check if backend isn't cpu
         if (!ggml_backend_is_cpu(backend) && (tensor->buffer == NULL || ggml_backend_buffer_is_host(tensor->buffer))) {
             // pass input tensors to gpu memory
@@ -1244,11 +1516,99 @@ public:
                  bool free_compute_buffer_immediately = true,
                  struct ggml_tensor** output          = NULL,
                  struct ggml_context* output_ctx      = NULL) {
+        int64_t t0 = ggml_time_us();
         alloc_compute_buffer(get_graph);
         reset_compute_ctx();
         struct ggml_cgraph* gf = get_graph();
-        GGML_ASSERT(ggml_gallocr_alloc_graph(compute_allocr, gf));
+        GGML_ASSERT(alloc_graph(gf));
         cpy_data_to_backend_tensor();
+        int64_t t1 = ggml_time_us();
+        compute_graph(gf, n_threads, output, output_ctx);
+        report_compute(t0, t1, ggml_time_us());
+
+        if (free_compute_buffer_immediately) {
+            free_compute_buffer();
+        }
+    }
+
+    // same as compute(), but the graph and its allocation are kept until the compute buffer is freed.
+    // As long as key and the shapes of inputs don't change, the next calls skip get_graph() and
+    // only upload the data of inputs again. Up to max_cached_graphs graphs with different keys are
+    // kept, so callers alternating between a few graphs don't rebuild them. Every host tensor the
+    // graph reads has to be in inputs. Data set with set_backend_tensor_data() while building the
+    // graph is copied and uploaded again on every call.
+    void compute_cached(get_graph_cb_t get_graph,
+                        const std::vector<struct ggml_tensor*>& inputs,
+                        const std::string& key,
+                        int n_threads,
+                        struct ggml_tensor** output     = NULL,
+                        struct ggml_context* output_ctx = NULL) {
+        int64_t t0            = ggml_time_us();
+        std::string graph_key = key;
+        for (auto tensor : inputs) {
+            graph_key += get_graph_input_key(tensor);
+        }
+
+        int64_t t1 = t0;
+        auto it    = cached_graphs.find(graph_key);
+        if (it == cached_graphs.end()) {
+            if (!alloc_compute_buffer(get_graph)) {
+                return;
+            }
+            if (cached_graphs.size() >= max_cached_graphs) {
+                evict_cached_graph();
+            }
+            reset_compute_ctx();
+            graph_inputs = inputs;
+            cached_graph_inputs.assign(inputs.size(), NULL);
+            struct ggml_cgraph* gf = get_graph();
+            graph_inputs.clear();
+            if (!alloc_graph(gf)) {
+                free_compute_ctx();
+                return;
+            }
+
+            // the context now belongs to the cached graph
+            CachedGraph& cached = cached_graphs[graph_key];
+            cached.ctx          = compute_ctx;
+            cached.graph        = gf;
+            cached.inputs       = cached_graph_inputs;
+            for (auto& kv : backend_tensor_data_map) {
+                const uint8_t* data = (const uint8_t*)kv.second;
+                cached.backend_tensor_data[kv.first].assign(data, data + ggml_nbytes(kv.first));
+            }
+            backend_tensor_data_map.clear();
+            compute_ctx = NULL;
+            it          = cached_graphs.find(graph_key);
+            t1          = ggml_time_us();
+        }
+        CachedGraph& cached = it->second;
+        cached.last_use     = ++cached_graph_uses;
+        for (auto& kv : cached.backend_tensor_data) {
+            set_backend_tensor_data(kv.first, kv.second.data());
+        }
+
+        for (size_t i = 0; i < inputs.size(); i++) {
+            // inputs the graph doesn't read are left unallocated
+            if (cached.inputs[i] == NULL || cached.inputs[i]->buffer == NULL) {
+                continue;
+            }
+            if (ggml_tensor_is_on_device(inputs[i])) {
+                ggml_backend_tensor_copy(inputs[i], cached.inputs[i]);
+            } else {
+                set_backend_tensor_data(cached.inputs[i], inputs[i]->data);
+            }
+        }
+        cpy_data_to_backend_tensor();
+        compute_graph(cached.graph, n_threads, output, output_ctx);
+        report_compute(t0, t1, ggml_time_us());
+    }
+
+protected:
+    void compute_graph(struct ggml_cgraph* gf,
+                       int n_threads,
+                       struct ggml_tensor** output,
+                       struct ggml_context* output_ctx) {
         if (ggml_backend_is_cpu(backend)) {
             ggml_backend_cpu_set_n_threads(backend, n_threads);
         }
@@ -1262,17 +1622,216 @@ public:
             if (*output == NULL && output_ctx != NULL) {
                 *output = ggml_dup_tensor(output_ctx, result);
             }
-            if (*output != NULL) {
+            if (*output != NULL && ggml_tensor_is_on_device(*output)) {
+                // stays on the device, see SamplerRunner
+                ggml_backend_tensor_copy(result, *output);
+            } else if (*output != NULL) {
                 ggml_backend_tensor_get_and_sync(backend, result, (*output)->data, 0, ggml_nbytes(*output));
             }
         }
+    }
+};
 
-        if (free_compute_buffer_immediately) {
-            free_compute_buffer();
+// Step-level feature cache of the diffusion models (first block cache / DeepCache).
+// Every evaluation first runs the first block only and compares its output with the one
+// of the last full evaluation of the same stream (cond, uncond, ...). If the relative
+// change stays below threshold, the deep part of the model is replaced with the residual
+// it produced in that full evaluation.
+struct StepCache {
+    enum Phase {
+        OFF,
+        PROBE,  // graph ends after the first block with [sum|h - first|, sum|first|]
+        FULL,   // full graph, saves the first block output and the residual
+        SKIP,   // the deep part is replaced with the saved residual
+    };
+
+    struct Slot {
+        struct ggml_context* ctx     = NULL;
+        ggml_backend_buffer_t buffer = NULL;
+        struct ggml_tensor* tensor   = NULL;
+    };
+
+    struct Entry {
+        int id     = 0;
+        bool valid = false;
+        Slot first;
+        Slot cached;
+    };
+
+    ggml_backend_t backend = NULL;
+    float threshold        = 0.f;
+    Phase phase            = OFF;
+    Entry* entry           = NULL;
+    // keyed by the context tensor of the evaluation, which is stable during a generation
+    std::map<const struct ggml_tensor*, Entry> entries;
+    std::vector<struct ggml_tensor*> pending;
+    int evaluations = 0;
+    int skipped     = 0;
+
+    ~StepCache() {
+        reset();
+    }
+
+    static void free_slot(Slot& slot) {
+        if (slot.buffer != NULL) {
+            ggml_backend_buffer_free(slot.buffer);
+        }
+        if (slot.ctx != NULL) {
+            ggml_free(slot.ctx);
         }
+        slot = Slot();
+    }
+
+    struct ggml_tensor* alloc_like(Slot& slot, struct ggml_tensor* like) {
+        if (slot.tensor != NULL && slot.tensor->type == like->type && ggml_are_same_shape(slot.tensor, like)) {
+            return slot.tensor;
+        }
+        free_slot(slot);
+        struct ggml_init_params params;
+        params.mem_size   = ggml_tensor_overhead() + 1024;
+        params.mem_buffer = NULL;
+        params.no_alloc   = true;
+
+        slot.ctx    = ggml_init(params);
+        slot.tensor = ggml_dup_tensor(slot.ctx, like);
+        slot.buffer = ggml_backend_alloc_ctx_tensors(slot.ctx, backend);
+        return slot.tensor;
+    }
+
+    bool probing() {
+        return phase == PROBE;
+    }
+
+    bool skipping() {
+        return phase == SKIP;
+    }
+
+    // called with the output of the first block, returns the graph output while probing
+    struct ggml_tensor* first_block(struct ggml_context* ctx, struct ggml_tensor* h) {
+        if (phase == PROBE) {
+            auto diff = ggml_sum(ctx, ggml_abs(ctx, ggml_sub(ctx, h, entry->first.tensor)));
+            auto norm = ggml_sum(ctx, ggml_abs(ctx, entry->first.tensor));
+            return ggml_concat(ctx, diff, norm, 0);  // [2, ]
+        }
+        if (phase == FULL) {
+            pending.push_back(ggml_cpy(ctx, h, alloc_like(entry->first, h)));
+        }
+        return NULL;
+    }
+
+    void save(struct ggml_context* ctx, struct ggml_tensor* t) {
+        if (phase == FULL) {
+            pending.push_back(ggml_cpy(ctx, t, alloc_like(entry->cached, t)));
+        }
+    }
+
+    struct ggml_tensor* saved() {
+        GGML_ASSERT(phase == SKIP && entry->cached.tensor != NULL);
+        return entry->cached.tensor;
+    }
+
+    // the copies aren't ancestors of the output, they go into the graph before it
+    void expand(struct ggml_cgraph* gf) {
+        for (auto t : pending) {
+            ggml_build_forward_expand(gf, t);
+        }
+        pending.clear();
+    }
+
+    std::string graph_key() {
+        if (phase == OFF) {
+            return "";
+        }
+        return ":step_cache:" + std::to_string((int)phase) + ":" + std::to_string(entry->id);
+    }
+
+    typedef std::function<void(struct ggml_tensor**, struct ggml_context*)> run_cb_t;
+
+    void evaluate(const struct ggml_tensor* stream,
+                  bool cacheable,
+                  run_cb_t run,
+                  struct ggml_tensor** output,
+                  struct ggml_context* output_ctx) {
+        if (threshold <= 0.f || !cacheable || stream == NULL) {
+            phase = OFF;
+            run(output, output_ctx);
+            return;
+        }
+        entry = &entries[stream];
+        if (entry->id == 0) {
+            entry->id = (int)entries.size();
+        }
+
+        phase = FULL;
+        if (entry->valid) {
+            float result[2];
+
+            struct ggml_init_params params;
+            params.mem_size   = ggml_tensor_overhead() + sizeof(result) + 1024;
+            params.mem_buffer = NULL;
+            params.no_alloc   = false;
+
+            struct ggml_context* probe_ctx = ggml_init(params);
+            struct ggml_tensor* probe      = ggml_new_tensor_1d(probe_ctx, GGML_TYPE_F32, 2);
+            phase                          = PROBE;
+            run(&probe, NULL);
+            memcpy(result, probe->data, sizeof(result));
+            ggml_free(probe_ctx);
+
+            float change = result[0] / (result[1] + 1e-6f);
+            phase        = change < threshold ? SKIP : FULL;
+        }
+        run(output, output_ctx);
+
+        evaluations++;
+        if (phase == SKIP) {
+            skipped++;
+        } else {
+            entry->valid = true;
+        }
+        phase = OFF;
+        entry = NULL;
+    }
+
+    void reset() {
+        for (auto& kv : entries) {
+            free_slot(kv.second.first);
+            free_slot(kv.second.cached);
+        }
+        entries.clear();
+        pending.clear();
+        evaluations = 0;
+        skipped     = 0;
     }
 };
 
+// LoRA applied in the forward pass of Linear/Conv2d: out += scale * up(down(x)),
+// the base weight stays untouched
+struct RuntimeLora {
+    struct ggml_tensor* down = NULL;
+    struct ggml_tensor* up   = NULL;
+    float scale              = 1.f;
+};
+
+typedef std::unordered_map<const struct ggml_tensor*, std::vector<RuntimeLora>> RuntimeLoraMap;
+
+// keyed by the base weight, owned by the runner whose blocks hold the weights
+__STATIC_INLINE__ const std::vector<RuntimeLora>* find_runtime_loras(const RuntimeLoraMap* runtime_loras, struct ggml_tensor* w) {
+    if (runtime_loras == NULL || runtime_loras->empty()) {
+        return NULL;
+    }
+    auto it = runtime_loras->find(w);
+    if (it == runtime_loras->end()) {
+        return NULL;
+    }
+    return &it->second;
+}
+
+// runtime LoRAs add a few nodes per patched weight
+__STATIC_INLINE__ size_t get_runtime_lora_graph_size(const RuntimeLoraMap& runtime_loras, size_t graph_size) {
+    return runtime_loras.empty() ? graph_size : MAX_GRAPH_SIZE;
+}
+
 class GGMLBlock {
 protected:
     typedef std::unordered_map<std::string, struct ggml_tensor*> ParameterMap;
@@ -1298,6 +1857,20 @@ public:
         init_params(ctx, tensor_types, prefix);
     }
 
+    // weights whose LoRA can be applied at runtime by the forward of their block
+    virtual void get_runtime_lora_targets(std::set<struct ggml_tensor*>& targets) {
+        for (auto& pair : blocks) {
+            pair.second->get_runtime_lora_targets(targets);
+        }
+    }
+
+    // the map the forward of Linear/Conv2d looks their weight up in, NULL disables runtime LoRAs
+    virtual void set_runtime_lora_map(const RuntimeLoraMap* runtime_loras) {
+        for (auto& pair : blocks) {
+            pair.second->set_runtime_lora_map(runtime_loras);
+        }
+    }
+
     size_t get_params_num() {
         size_t num_tensors = params.size();
         for (auto& pair : blocks) {
@@ -1350,6 +1923,7 @@ protected:
     int64_t out_features;
     bool bias;
     bool force_f32;
+    const RuntimeLoraMap* runtime_loras = NULL;
 
     void init_params(struct ggml_context* ctx, std::map<std::string, enum ggml_type>& tensor_types, const std::string prefix = "") {
         enum ggml_type wtype = (tensor_types.find(prefix + "weight") != tensor_types.end()) ? tensor_types[prefix + "weight"] : GGML_TYPE_F32;
@@ -1373,13 +1947,34 @@ public:
           bias(bias),
           force_f32(force_f32) {}
 
+    void get_runtime_lora_targets(std::set<struct ggml_tensor*>& targets) {
+        targets.insert(params["weight"]);
+    }
+
+    void set_runtime_lora_map(const RuntimeLoraMap* runtime_loras) {
+        this->runtime_loras = runtime_loras;
+    }
+
     struct ggml_tensor* forward(struct ggml_context* ctx, struct ggml_tensor* x) {
         struct ggml_tensor* w = params["weight"];
         struct ggml_tensor* b = NULL;
         if (bias) {
             b = params["bias"];
         }
-        return ggml_nn_linear(ctx, x, w, b);
+        struct ggml_tensor* out = ggml_nn_linear(ctx, x, w, b);
+
+        auto loras = find_runtime_loras(runtime_loras, w);
+        if (loras != NULL) {
+            for (auto& lora : *loras) {
+                // down: [rank, in_features], up: [out_features, rank], maybe stored as 1x1 convs
+                int64_t rank = ggml_nelements(lora.up) / w->ne[1];
+                auto down    = ggml_reshape_2d(ctx, lora.down, w->ne[0], rank);
+                auto up      = ggml_reshape_2d(ctx, lora.up, rank, w->ne[1]);
+                auto h       = ggml_mul_mat(ctx, up, ggml_mul_mat(ctx, down, x));
+                out          = ggml_add(ctx, out, ggml_scale(ctx, h, lora.scale));
+            }
+        }
+        return out;
     }
 };
 
@@ -1426,6 +2021,7 @@ protected:
     std::pair<int, int> padding;
     std::pair<int, int> dilation;
     bool bias;
+    const RuntimeLoraMap* runtime_loras = NULL;
 
     void init_params(struct ggml_context* ctx, std::map<std::string, enum ggml_type>& tensor_types, const std::string prefix = "") {
         enum ggml_type wtype = GGML_TYPE_F16;  //(tensor_types.find(prefix + "weight") != tensor_types.end()) ? tensor_types[prefix + "weight"] : GGML_TYPE_F16;
@@ -1452,13 +2048,35 @@ public:
           dilation(dilation),
           bias(bias) {}
 
+    void get_runtime_lora_targets(std::set<struct ggml_tensor*>& targets) {
+        targets.insert(params["weight"]);
+    }
+
+    void set_runtime_lora_map(const RuntimeLoraMap* runtime_loras) {
+        this->runtime_loras = runtime_loras;
+    }
+
     struct ggml_tensor* forward(struct ggml_context* ctx, struct ggml_tensor* x) {
         struct ggml_tensor* w = params["weight"];
         struct ggml_tensor* b = NULL;
         if (bias) {
             b = params["bias"];
         }
-        return ggml_nn_conv_2d(ctx, x, w, b, stride.second, stride.first, padding.second, padding.first, dilation.second, dilation.first);
+        struct ggml_tensor* out = ggml_nn_conv_2d(ctx, x, w, b, stride.second, stride.first, padding.second, padding.first, dilation.second, dilation.first);
+
+        auto loras = find_runtime_loras(runtime_loras, w);
+        if (loras != NULL) {
+            for (auto& lora : *loras) {
+                // down: [rank, in_channels, kh, kw], up: [out_channels, rank, 1, 1]
+                int64_t rank = ggml_nelements(lora.up) / w->ne[3];
+                auto down    = ggml_reshape_4d(ctx, lora.down, w->ne[0], w->ne[1], w->ne[2], rank);
+                auto up      = ggml_reshape_4d(ctx, lora.up, 1, 1, rank, w->ne[3]);
+                auto h       = ggml_nn_conv_2d(ctx, x, down, NULL, stride.second, stride.first, padding.second, padding.first, dilation.second, dilation.first);
+                h            = ggml_nn_conv_2d(ctx, h, up);
+                out          = ggml_add(ctx, out, ggml_scale(ctx, h, lora.scale));
+            }
+        }
+        return out;
     }
 };
 
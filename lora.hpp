@@ -99,6 +99,11 @@ struct LoraModel : public GGMLRunner {
     std::vector<int> zero_index_vec = {0};
     ggml_tensor* zero_index         = NULL;
     enum lora_t type                = REGULAR;
+    // lora tensors handed out by get_runtime_loras, not merged by apply
+    std::set<std::string> runtime_lora_tensors;
+    // apply() merges the weights in chunks, each needing at most this much compute memory
+    // unless a single weight needs more
+    size_t max_chunk_size = 256 * 1024 * 1024;
 
     LoraModel(ggml_backend_t backend,
               const std::string& file_path = "",
@@ -237,7 +242,12 @@ struct LoraModel : public GGMLRunner {
         return ret;
     }
 
-    struct ggml_cgraph* build_lora_graph(std::map<std::string, struct ggml_tensor*> model_tensors, SDVersion version) {
+    // Merges the weights in chunk, or all of them if chunk is NULL.
+    // plan gets the weights merged and the compute memory each of them needs.
+    struct ggml_cgraph* build_lora_graph(const std::map<std::string, struct ggml_tensor*>& model_tensors,
+                                         SDVersion version,
+                                         const std::set<std::string>* chunk                 = NULL,
+                                         std::vector<std::pair<std::string, size_t>>* plan = NULL) {
         struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, LORA_GRAPH_SIZE, false);
 
         zero_index = ggml_new_tensor_1d(compute_ctx, GGML_TYPE_I32, 1);
@@ -245,9 +255,13 @@ struct LoraModel : public GGMLRunner {
         ggml_build_forward_expand(gf, zero_index);
 
         std::set<std::string> applied_lora_tensors;
-        for (auto it : model_tensors) {
+        for (auto& it : model_tensors) {
+            if (chunk != NULL && chunk->find(it.first) == chunk->end()) {
+                continue;
+            }
             std::string k_tensor       = it.first;
-            struct ggml_tensor* weight = model_tensors[it.first];
+            struct ggml_tensor* weight = it.second;
+            int n_nodes                = ggml_graph_n_nodes(gf);
 
             std::vector<std::string> keys = to_lora_keys(k_tensor, version);
             if (keys.size() == 0)
@@ -804,15 +818,29 @@ struct LoraModel : public GGMLRunner {
                 }
                 // final_weight = ggml_add_inplace(compute_ctx, weight, updown);  // apply directly
                 ggml_build_forward_expand(gf, final_weight);
+                if (plan != NULL) {
+                    size_t size = 0;
+                    for (int i = n_nodes; i < ggml_graph_n_nodes(gf); i++) {
+                        struct ggml_tensor* node = ggml_graph_node(gf, i);
+                        if (node->view_src == NULL) {
+                            size += ggml_nbytes(node);
+                        }
+                    }
+                    plan->push_back(std::make_pair(k_tensor, size));
+                }
                 break;
             }
         }
+        if (chunk != NULL) {
+            return gf;
+        }
         size_t total_lora_tensors_count   = 0;
         size_t applied_lora_tensors_count = 0;
 
         for (auto& kv : lora_tensors) {
             total_lora_tensors_count++;
-            if (applied_lora_tensors.find(kv.first) == applied_lora_tensors.end()) {
+            if (applied_lora_tensors.find(kv.first) == applied_lora_tensors.end() &&
+                runtime_lora_tensors.find(kv.first) == runtime_lora_tensors.end()) {
                 LOG_WARN("unused lora tensor |%s|", kv.first.c_str());
                 print_ggml_tensor(kv.second, true);
                 // exit(0);
@@ -820,9 +848,6 @@ struct LoraModel : public GGMLRunner {
                 applied_lora_tensors_count++;
             }
         }
-        /* Don't worry if this message shows up twice in the logs per LoRA,
-         * this function is called once to calculate the required buffer size
-         * and then again to actually generate a graph to be used */
         if (applied_lora_tensors_count != total_lora_tensors_count) {
             LOG_WARN("Only (%lu / %lu) LoRA tensors have been applied",
                      applied_lora_tensors_count, total_lora_tensors_count);
@@ -834,11 +859,108 @@ struct LoraModel : public GGMLRunner {
         return gf;
     }
 
-    void apply(std::map<std::string, struct ggml_tensor*> model_tensors, SDVersion version, int n_threads) {
-        auto get_graph = [&]() -> struct ggml_cgraph* {
-            return build_lora_graph(model_tensors, version);
+    // Collects the plain up/down pairs of the target weights so they can be applied in the forward pass,
+    // LoHa/LoKr, tucker and split qkv weights are left to apply().
+    // Returns the names of the model tensors taken.
+    std::set<std::string> get_runtime_loras(const std::map<std::string, struct ggml_tensor*>& model_tensors,
+                                            const std::set<struct ggml_tensor*>& targets,
+                                            SDVersion version,
+                                            RuntimeLoraMap* runtime_loras) {
+        std::set<std::string> taken;
+        runtime_lora_tensors.clear();
+        for (auto it : model_tensors) {
+            struct ggml_tensor* weight = it.second;
+            if (targets.find(weight) == targets.end()) {
+                continue;
+            }
+
+            std::vector<std::string> keys = to_lora_keys(it.first, version);
+            for (auto& key : keys) {
+                if (starts_with(key, "SPLIT|") || starts_with(key, "SPLIT_L|")) {
+                    continue;
+                }
+                std::string fk = lora_pre[type] + key;
+                if (lora_tensors.find(fk + ".hada_w1_a") != lora_tensors.end() ||
+                    lora_tensors.find(fk + ".lokr_w1") != lora_tensors.end() ||
+                    lora_tensors.find(fk + ".lokr_w1_a") != lora_tensors.end()) {
+                    break;
+                }
+                std::string lora_up_name   = fk + lora_ups[type] + ".weight";
+                std::string lora_down_name = fk + lora_downs[type] + ".weight";
+                std::string lora_mid_name  = fk + ".lora_mid.weight";
+                std::string alpha_name     = fk + ".alpha";
+                std::string scale_name     = fk + ".scale";
+                if (lora_tensors.find(lora_up_name) == lora_tensors.end() ||
+                    lora_tensors.find(lora_down_name) == lora_tensors.end()) {
+                    continue;
+                }
+                if (lora_tensors.find(lora_mid_name) != lora_tensors.end()) {
+                    break;
+                }
+                ggml_tensor* lora_up   = lora_tensors[lora_up_name];
+                ggml_tensor* lora_down = lora_tensors[lora_down_name];
+
+                // Linear: [out, in], Conv2d: [out, in, kh, kw]
+                int64_t out_features = ggml_n_dims(weight) <= 2 ? weight->ne[1] : weight->ne[3];
+                int64_t rank         = ggml_nelements(lora_up) / out_features;
+                if (rank <= 0 || rank * out_features != ggml_nelements(lora_up) ||
+                    ggml_nelements(lora_down) != rank * (ggml_nelements(weight) / out_features)) {
+                    break;
+                }
+
+                float scale_value = 1.0f;
+                if (lora_tensors.find(scale_name) != lora_tensors.end()) {
+                    scale_value = ggml_backend_tensor_get_f32(lora_tensors[scale_name]);
+                } else if (lora_tensors.find(alpha_name) != lora_tensors.end()) {
+                    float alpha = ggml_backend_tensor_get_f32(lora_tensors[alpha_name]);
+                    scale_value = alpha / rank;
+                }
+
+                if (runtime_loras != NULL) {
+                    RuntimeLora runtime_lora;
+                    runtime_lora.down  = lora_down;
+                    runtime_lora.up    = lora_up;
+                    runtime_lora.scale = scale_value * multiplier;
+                    (*runtime_loras)[weight].push_back(runtime_lora);
+                }
+                runtime_lora_tensors.insert(lora_up_name);
+                runtime_lora_tensors.insert(lora_down_name);
+                runtime_lora_tensors.insert(alpha_name);
+                runtime_lora_tensors.insert(scale_name);
+                taken.insert(it.first);
+                break;
+            }
+        }
+        return taken;
+    }
+
+    // The weights are merged in chunks of at most max_chunk_size compute memory, the compute
+    // buffer of a chunk is released before the next one. The graph over all weights is only
+    // built, not allocated, to find the weights to merge.
+    void apply(const std::map<std::string, struct ggml_tensor*>& model_tensors, SDVersion version, int n_threads) {
+        std::vector<std::pair<std::string, size_t>> plan;
+        reset_compute_ctx();
+        build_lora_graph(model_tensors, version, NULL, &plan);
+        backend_tensor_data_map.clear();
+        free_compute_ctx();
+
+        std::set<std::string> chunk;
+        size_t chunk_size = 0;
+        int n_chunks      = 0;
+        auto get_graph    = [&]() -> struct ggml_cgraph* {
+            return build_lora_graph(model_tensors, version, &chunk);
         };
-        GGMLRunner::compute(get_graph, n_threads, true);
+        for (size_t i = 0; i < plan.size(); i++) {
+            chunk.insert(plan[i].first);
+            chunk_size += plan[i].second;
+            if (i + 1 == plan.size() || chunk_size + plan[i + 1].second > max_chunk_size) {
+                GGMLRunner::compute(get_graph, n_threads, true);
+                chunk.clear();
+                chunk_size = 0;
+                n_chunks++;
+            }
+        }
+        LOG_DEBUG("%zu weights merged in %d chunks", plan.size(), n_chunks);
     }
 };
 
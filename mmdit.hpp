@@ -798,13 +798,15 @@ public:
                                                  struct ggml_tensor* x,
                                                  struct ggml_tensor* c_mod,
                                                  struct ggml_tensor* context,
-                                                 std::vector<int> skip_layers = std::vector<int>()) {
+                                                 std::vector<int> skip_layers = std::vector<int>(),
+                                                 StepCache* step_cache        = NULL) {
         // x: [N, H*W, hidden_size]
         // context: [N, n_context, d_context]
         // c: [N, hidden_size]
         // return: [N, N*W, patch_size * patch_size * out_channels]
         auto final_layer = std::dynamic_pointer_cast<FinalLayer>(blocks["final_layer"]);
 
+        struct ggml_tensor* first = NULL;
         for (int i = 0; i < depth; i++) {
             // skip iteration if i is in skip_layers
             if (skip_layers.size() > 0 && std::find(skip_layers.begin(), skip_layers.end(), i) != skip_layers.end()) {
@@ -816,6 +818,22 @@ public:
             auto context_x = block->forward(ctx, context, x, c_mod);
             context        = context_x.first;
             x              = context_x.second;
+
+            if (step_cache != NULL && i == 0) {
+                first       = x;
+                auto change = step_cache->first_block(ctx, x);
+                if (change != NULL) {
+                    return change;
+                }
+                if (step_cache->skipping()) {
+                    // the remaining blocks add the residual of the last full evaluation
+                    x = ggml_add(ctx, x, step_cache->saved());
+                    break;
+                }
+            }
+        }
+        if (first != NULL && !step_cache->skipping()) {
+            step_cache->save(ctx, ggml_sub(ctx, x, first));
         }
 
         x = final_layer->forward(ctx, x, c_mod);  // (N, T, patch_size ** 2 * out_channels)
@@ -828,7 +846,8 @@ public:
                                 struct ggml_tensor* t,
                                 struct ggml_tensor* y        = NULL,
                                 struct ggml_tensor* context  = NULL,
-                                std::vector<int> skip_layers = std::vector<int>()) {
+                                std::vector<int> skip_layers = std::vector<int>(),
+                                StepCache* step_cache        = NULL) {
         // Forward pass of DiT.
         // x: (N, C, H, W) tensor of spatial inputs (images or latent representations of images)
         // t: (N,) tensor of diffusion timesteps
@@ -859,7 +878,10 @@ public:
             context = context_embedder->forward(ctx, context);  // [N, L, D] aka [N, L, 1536]
         }
 
-        x = forward_core_with_concat(ctx, x, c, context, skip_layers);  // (N, H*W, patch_size ** 2 * out_channels)
+        x = forward_core_with_concat(ctx, x, c, context, skip_layers, step_cache);  // (N, H*W, patch_size ** 2 * out_channels)
+        if (step_cache != NULL && step_cache->probing()) {
+            return x;
+        }
 
         x = unpatchify(ctx, x, h, w);  // [N, C, H, W]
 
@@ -868,6 +890,8 @@ public:
 };
 struct MMDiTRunner : public GGMLRunner {
     MMDiT mmdit;
+    StepCache step_cache;
+    RuntimeLoraMap runtime_loras;
 
     static std::map<std::string, enum ggml_type> empty_tensor_types;
 
@@ -876,6 +900,8 @@ struct MMDiTRunner : public GGMLRunner {
                 const std::string prefix                            = "")
         : GGMLRunner(backend), mmdit(tensor_types) {
         mmdit.init(params_ctx, tensor_types, prefix);
+        mmdit.set_runtime_lora_map(&runtime_loras);
+        step_cache.backend = backend;
     }
 
     std::string get_desc() {
@@ -891,7 +917,7 @@ struct MMDiTRunner : public GGMLRunner {
                                     struct ggml_tensor* context,
                                     struct ggml_tensor* y,
                                     std::vector<int> skip_layers = std::vector<int>()) {
-        struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, MMDIT_GRAPH_SIZE, false);
+        struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, get_runtime_lora_graph_size(runtime_loras, MMDIT_GRAPH_SIZE), false);
 
         x         = to_backend(x);
         context   = to_backend(context);
@@ -903,8 +929,10 @@ struct MMDiTRunner : public GGMLRunner {
                                                 timesteps,
                                                 y,
                                                 context,
-                                                skip_layers);
+                                                skip_layers,
+                                                &step_cache);
 
+        step_cache.expand(gf);
         ggml_build_forward_expand(gf, out);
 
         return gf;
@@ -926,7 +954,14 @@ struct MMDiTRunner : public GGMLRunner {
             return build_graph(x, timesteps, context, y, skip_layers);
         };
 
-        GGMLRunner::compute(get_graph, n_threads, false, output, output_ctx);
+        std::string key = "mmdit:";
+        for (int layer : skip_layers) {
+            key += std::to_string(layer) + ",";
+        }
+        auto run = [&](struct ggml_tensor** out, struct ggml_context* out_ctx) {
+            GGMLRunner::compute_cached(get_graph, {x, timesteps, context, y}, key + step_cache.graph_key(), n_threads, out, out_ctx);
+        };
+        step_cache.evaluate(context, skip_layers.empty(), run, output, output_ctx);
     }
 
     void test() {
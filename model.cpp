@@ -1,8 +1,12 @@
 #include <stdarg.h>
+#include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <mutex>
 #include <regex>
 #include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -10,6 +14,9 @@
 #include "stable-diffusion.h"
 #include "util.h"
 #include "vocab.hpp"
+#ifndef SD_T5_TOKENIZER_JSON
+#include "t5_tokenizer_bin.hpp"
+#endif
 
 #include "ggml-alloc.h"
 #include "ggml-backend.h"
@@ -1266,26 +1273,18 @@ struct PickleTensorReader {
         }
     }
 
-    void read_string(const std::string& str, struct zip_t* zip, std::string dir) {
+    // zip entry name -> (index, uncompressed size)
+    typedef std::unordered_map<std::string, std::pair<int, size_t>> ZipEntries;
+
+    void read_string(const std::string& str, const ZipEntries& entries, std::string dir) {
         if (str == "storage") {
             read_global_type = true;
         } else if (str != "state_dict") {
             if (phase == READ_DATA) {
-                std::string entry_name = dir + "data/" + std::string(str);
-
-                size_t i, n = zip_entries_total(zip);
-                for (i = 0; i < n; ++i) {
-                    zip_entry_openbyindex(zip, i);
-                    {
-                        std::string name = zip_entry_name(zip);
-                        if (name == entry_name) {
-                            tensor_storage.index_in_zip = (int)i;
-                            entry_size                  = zip_entry_size(zip);
-                            zip_entry_close(zip);
-                            break;
-                        }
-                    }
-                    zip_entry_close(zip);
+                auto it = entries.find(dir + "data/" + std::string(str));
+                if (it != entries.end()) {
+                    tensor_storage.index_in_zip = it->second.first;
+                    entry_size                  = it->second.second;
                 }
 
                 phase = entry_size > 0 ? CHECK_SIZE : READ_NAME;
@@ -1329,6 +1328,14 @@ bool ModelLoader::parse_data_pkl(uint8_t* buffer,
         char string_buffer[MAX_STRING_BUFFER];
         bool finish = false;
         PickleTensorReader reader;
+        // index the entries once instead of scanning the archive for every tensor
+        PickleTensorReader::ZipEntries entries;
+        size_t n_entries = zip_entries_total(zip);
+        for (size_t i = 0; i < n_entries; i++) {
+            zip_entry_openbyindex(zip, i);
+            entries[zip_entry_name(zip)] = {(int)i, (size_t)zip_entry_size(zip)};
+            zip_entry_close(zip);
+        }
         // read pickle binary file
         while (!finish && buffer < buffer_end) {
             uint8_t opcode = *buffer;
@@ -1390,7 +1397,7 @@ bool ModelLoader::parse_data_pkl(uint8_t* buffer,
                     }
                     memcpy(string_buffer, buffer, len < MAX_STRING_BUFFER ? len : (MAX_STRING_BUFFER - 1));
                     buffer += len;
-                    reader.read_string(string_buffer, zip, dir);
+                    reader.read_string(string_buffer, entries, dir);
                 } break;
                 case 0x8C:  // SHORT_BINUNICODE = b'\x8c'  # push short string; UTF-8 length < 256 bytes
                 {
@@ -1473,6 +1480,40 @@ bool ModelLoader::init_from_ckpt_file(const std::string& file_path, const std::s
         }
         zip_entry_close(zip);
     }
+
+    // torch.save stores the tensor data uncompressed, point those tensors straight at
+    // their bytes in the file so they are loaded like safetensors
+    std::ifstream file(file_path, std::ios::binary);
+    std::map<int, int64_t> data_offsets;  // index in zip -> offset of the data, -1 if compressed
+    size_t n_raw = 0;
+    for (auto& tensor_storage : tensor_storages) {
+        if (tensor_storage.file_index != file_index || tensor_storage.index_in_zip < 0) {
+            continue;
+        }
+        auto it = data_offsets.find(tensor_storage.index_in_zip);
+        if (it == data_offsets.end()) {
+            int64_t data_offset = -1;
+            zip_entry_openbyindex(zip, tensor_storage.index_in_zip);
+            if (zip_entry_comp_size(zip) == zip_entry_uncomp_size(zip)) {
+                // local file header: method at 8, name and extra field lengths at 26 and 28
+                uint8_t header[30];
+                file.seekg(zip_entry_header_offset(zip));
+                file.read((char*)header, sizeof(header));
+                if (file && (uint32_t)read_int(header) == 0x04034b50 && read_short(header + 8) == 0) {
+                    data_offset = zip_entry_header_offset(zip) + sizeof(header) + read_short(header + 26) + read_short(header + 28);
+                }
+                file.clear();
+            }
+            zip_entry_close(zip);
+            it = data_offsets.insert({tensor_storage.index_in_zip, data_offset}).first;
+        }
+        if (it->second >= 0) {
+            tensor_storage.offset += it->second;
+            tensor_storage.index_in_zip = -1;
+            n_raw++;
+        }
+    }
+    LOG_DEBUG("%zu tensors of '%s' are stored uncompressed", n_raw, file_path.c_str());
     zip_close(zip);
     return true;
 }
@@ -1681,11 +1722,26 @@ std::string ModelLoader::load_merges() {
     return merges_utf8_str;
 }
 
+#ifdef SD_T5_TOKENIZER_JSON
 std::string ModelLoader::load_t5_tokenizer_json() {
     std::string json_str(reinterpret_cast<const char*>(t5_tokenizer_json_str), sizeof(t5_tokenizer_json_str));
     return json_str;
 }
 
+std::pair<const uint32_t*, size_t> ModelLoader::load_t5_tokenizer_bin() {
+    return std::make_pair((const uint32_t*)NULL, (size_t)0);
+}
+#else
+// the json isn't referenced, so the copy in vocab.hpp doesn't end up in the library
+std::string ModelLoader::load_t5_tokenizer_json() {
+    return "";
+}
+
+std::pair<const uint32_t*, size_t> ModelLoader::load_t5_tokenizer_bin() {
+    return std::make_pair(t5_tokenizer_bin, sizeof(t5_tokenizer_bin) / sizeof(t5_tokenizer_bin[0]));
+}
+#endif
+
 std::vector<TensorStorage> remove_duplicates(const std::vector<TensorStorage>& vec) {
     std::vector<TensorStorage> res;
     std::unordered_map<std::string, size_t> name_to_index_map;
@@ -1707,7 +1763,11 @@ std::vector<TensorStorage> remove_duplicates(const std::vector<TensorStorage>& v
     return res;
 }
 
-bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend_t backend) {
+bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb,
+                               ggml_backend_t backend,
+                               int n_threads,
+                               on_batch_full_cb_t on_batch_full_cb,
+                               on_batch_loaded_cb_t on_batch_loaded_cb) {
     std::vector<TensorStorage> processed_tensor_storages;
     for (auto& tensor_storage : tensor_storages) {
         // LOG_DEBUG("%s", name.c_str());
@@ -1721,7 +1781,12 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
     std::vector<TensorStorage> dedup = remove_duplicates(processed_tensor_storages);
     processed_tensor_storages        = dedup;
 
-    bool success = true;
+    if (n_threads <= 0) {
+        n_threads = get_num_physical_cores();
+    }
+
+    bool success      = true;
+    bool batch_pending = false;  // tensors were handed out since the last on_batch_loaded_cb
     for (size_t file_index = 0; file_index < file_paths_.size(); file_index++) {
         std::string file_path = file_paths_[file_index];
         LOG_DEBUG("loading tensors from %s", file_path.c_str());
@@ -1731,6 +1796,7 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
             LOG_ERROR("failed to open '%s'", file_path.c_str());
             return false;
         }
+        file.close();
 
         bool is_zip = false;
         for (auto& tensor_storage : tensor_storages) {
@@ -1752,38 +1818,218 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
             }
         }
 
-        std::vector<uint8_t> read_buffer;
-        std::vector<uint8_t> convert_buffer;
+        // safetensors, gguf and uncompressed ckpt tensors are read straight from the mapped file,
+        // fall back to plain reads if the file can't be mapped
+        std::unique_ptr<MmapFile> mmap_file = MmapFile::open(file_path);
+        if (mmap_file == nullptr) {
+            LOG_DEBUG("failed to mmap '%s', reading it instead", file_path.c_str());
+        }
+
+        // the callbacks set up the destination tensors on this thread,
+        // reading and converting the data is spread over the worker threads
+        std::vector<std::pair<const TensorStorage*, ggml_tensor*>> tensors_to_load;
 
-        auto read_data = [&](const TensorStorage& tensor_storage, char* buf, size_t n) {
+        // loads tensors_to_load and clears it
+        auto load_batch = [&]() -> bool {
+            // tensors sharing a compressed zip entry are loaded one after another, so the entry
+            // is inflated only once
+            std::map<int, int> zip_entry_refs;
             if (zip != NULL) {
-                zip_entry_openbyindex(zip, tensor_storage.index_in_zip);
-                size_t entry_size = zip_entry_size(zip);
-                if (entry_size != n) {
-                    read_buffer.resize(entry_size);
-                    zip_entry_noallocread(zip, (void*)read_buffer.data(), entry_size);
-                    memcpy((void*)buf, (void*)(read_buffer.data() + tensor_storage.offset), n);
-                } else {
-                    zip_entry_noallocread(zip, (void*)buf, n);
+                std::stable_sort(tensors_to_load.begin(), tensors_to_load.end(),
+                                 [](const std::pair<const TensorStorage*, ggml_tensor*>& a,
+                                    const std::pair<const TensorStorage*, ggml_tensor*>& b) {
+                                     return a.first->index_in_zip < b.first->index_in_zip;
+                                 });
+                for (auto& tensor : tensors_to_load) {
+                    zip_entry_refs[tensor.first->index_in_zip]++;
                 }
-                zip_entry_close(zip);
-            } else {
-                file.seekg(tensor_storage.offset);
-                file.read(buf, n);
-                if (!file) {
-                    LOG_ERROR("read tensor data failed: '%s'", file_path.c_str());
-                    return false;
+            }
+            int tensor_count = 0;
+
+            // zip entries are read through one shared handle
+            int n_workers = is_zip ? 1 : std::max(1, std::min(n_threads, (int)tensors_to_load.size()));
+
+            std::atomic<size_t> next_tensor(0);
+            std::atomic<bool> failed(false);
+            std::mutex progress_mutex;
+            std::mutex upload_mutex;
+            int64_t t1 = ggml_time_ms();
+
+            auto load_worker = [&]() {
+                std::ifstream worker_file;
+                if (mmap_file == nullptr) {
+                    worker_file.open(file_path, std::ios::binary);
                 }
+                std::vector<uint8_t> read_buffer;
+                std::vector<uint8_t> convert_buffer;
+                std::vector<uint8_t> entry_buffer;
+                int cached_entry = -1;
+
+                auto is_mapped = [&](const TensorStorage& tensor_storage) {
+                    return mmap_file != nullptr && tensor_storage.index_in_zip < 0;
+                };
+
+                auto read_data = [&](const TensorStorage& tensor_storage, char* buf, size_t n) {
+                    if (tensor_storage.index_in_zip >= 0) {
+                        int index = tensor_storage.index_in_zip;
+                        if (index != cached_entry) {
+                            zip_entry_openbyindex(zip, index);
+                            size_t entry_size = zip_entry_size(zip);
+                            if (entry_size == n && zip_entry_refs[index] == 1) {
+                                // the only tensor of the entry, inflate straight into it
+                                bool ok = zip_entry_noallocread(zip, (void*)buf, n) == (ssize_t)n;
+                                zip_entry_close(zip);
+                                if (!ok) {
+                                    LOG_ERROR("read tensor data failed: '%s'", file_path.c_str());
+                                }
+                                return ok;
+                            }
+                            entry_buffer.resize(entry_size);
+                            bool ok = zip_entry_noallocread(zip, (void*)entry_buffer.data(), entry_size) == (ssize_t)entry_size;
+                            zip_entry_close(zip);
+                            if (!ok) {
+                                LOG_ERROR("read tensor data failed: '%s'", file_path.c_str());
+                                cached_entry = -1;
+                                return false;
+                            }
+                            cached_entry = index;
+                        }
+                        if (tensor_storage.offset + n > entry_buffer.size()) {
+                            LOG_ERROR("read tensor data failed: '%s'", file_path.c_str());
+                            return false;
+                        }
+                        memcpy((void*)buf, (void*)(entry_buffer.data() + tensor_storage.offset), n);
+                    } else if (mmap_file != nullptr) {
+                        if (tensor_storage.offset + n > mmap_file->size()) {
+                            LOG_ERROR("read tensor data failed: '%s'", file_path.c_str());
+                            return false;
+                        }
+                        memcpy(buf, mmap_file->data() + tensor_storage.offset, n);
+                    } else {
+                        worker_file.seekg(tensor_storage.offset);
+                        worker_file.read(buf, n);
+                        if (!worker_file) {
+                            LOG_ERROR("read tensor data failed: '%s'", file_path.c_str());
+                            return false;
+                        }
+                    }
+                    return true;
+                };
+
+                // fills buf (nbytes() big) with the tensor data, bf16/f8 are widened on the way
+                auto load_data = [&](const TensorStorage& tensor_storage, char* buf) {
+                    size_t n        = tensor_storage.nbytes_to_read();
+                    bool widen      = tensor_storage.is_bf16 || tensor_storage.is_f8_e4m3 || tensor_storage.is_f8_e5m2;
+                    const void* src = buf;
+                    if (is_mapped(tensor_storage) && widen) {
+                        if (tensor_storage.offset + n > mmap_file->size()) {
+                            LOG_ERROR("read tensor data failed: '%s'", file_path.c_str());
+                            return false;
+                        }
+                        src = mmap_file->data() + tensor_storage.offset;
+                    } else if (!read_data(tensor_storage, buf, n)) {
+                        return false;
+                    }
+
+                    if (tensor_storage.is_bf16) {
+                        // inplace op if src == buf
+                        bf16_to_f32_vec((uint16_t*)src, (float*)buf, tensor_storage.nelements());
+                    } else if (tensor_storage.is_f8_e4m3) {
+                        f8_e4m3_to_f16_vec((uint8_t*)src, (uint16_t*)buf, tensor_storage.nelements());
+                    } else if (tensor_storage.is_f8_e5m2) {
+                        f8_e5m2_to_f16_vec((uint8_t*)src, (uint16_t*)buf, tensor_storage.nelements());
+                    }
+                    return true;
+                };
+
+                // tensor data in tensor_storage.type, points into the mapped file when no widening is needed
+                auto get_data = [&](const TensorStorage& tensor_storage) -> const void* {
+                    bool widen = tensor_storage.is_bf16 || tensor_storage.is_f8_e4m3 || tensor_storage.is_f8_e5m2;
+                    if (is_mapped(tensor_storage) && !widen) {
+                        if (tensor_storage.offset + tensor_storage.nbytes() > mmap_file->size()) {
+                            LOG_ERROR("read tensor data failed: '%s'", file_path.c_str());
+                            return NULL;
+                        }
+                        return mmap_file->data() + tensor_storage.offset;
+                    }
+                    read_buffer.resize(tensor_storage.nbytes());
+                    if (!load_data(tensor_storage, (char*)read_buffer.data())) {
+                        return NULL;
+                    }
+                    return read_buffer.data();
+                };
+
+                while (!failed) {
+                    size_t i = next_tensor++;
+                    if (i >= tensors_to_load.size()) {
+                        break;
+                    }
+                    const TensorStorage& tensor_storage = *tensors_to_load[i].first;
+                    ggml_tensor* dst_tensor             = tensors_to_load[i].second;
+
+                    bool ok      = true;
+                    bool is_host = dst_tensor->buffer == NULL || ggml_backend_buffer_is_host(dst_tensor->buffer);
+                    if (is_host && tensor_storage.type == dst_tensor->type) {
+                        // for the CPU and Metal backend, we can copy directly into the tensor
+                        GGML_ASSERT(ggml_nbytes(dst_tensor) == tensor_storage.nbytes());
+                        ok = load_data(tensor_storage, (char*)dst_tensor->data);
+                    } else {
+                        const void* data = get_data(tensor_storage);
+                        ok               = data != NULL;
+                        if (ok && tensor_storage.type == dst_tensor->type) {
+                            // copy to device memory
+                            std::lock_guard<std::mutex> lock(upload_mutex);
+                            ggml_backend_tensor_set(dst_tensor, data, 0, ggml_nbytes(dst_tensor));
+                        } else if (ok) {
+                            // convert first, then copy to device memory if needed
+                            void* convert_dst = dst_tensor->data;
+                            if (!is_host) {
+                                convert_buffer.resize(ggml_nbytes(dst_tensor));
+                                convert_dst = (void*)convert_buffer.data();
+                            }
+                            convert_tensor((void*)data, tensor_storage.type, convert_dst, dst_tensor->type,
+                                           (int)tensor_storage.nelements() / (int)tensor_storage.ne[0], (int)tensor_storage.ne[0]);
+                            if (!is_host) {
+                                std::lock_guard<std::mutex> lock(upload_mutex);
+                                ggml_backend_tensor_set(dst_tensor, convert_buffer.data(), 0, ggml_nbytes(dst_tensor));
+                            }
+                        }
+                    }
+                    if (!ok) {
+                        failed = true;
+                        break;
+                    }
+
+                    std::lock_guard<std::mutex> lock(progress_mutex);
+                    int64_t t2 = ggml_time_ms();
+                    pretty_progress(++tensor_count, (int)tensors_to_load.size(), (t2 - t1) / 1000.0f);
+                    t1 = t2;
+                }
+            };
+
+            std::vector<std::thread> workers;
+            for (int i = 1; i < n_workers; i++) {
+                workers.emplace_back(load_worker);
             }
-            return true;
+            load_worker();
+            for (auto& worker : workers) {
+                worker.join();
+            }
+            tensors_to_load.clear();
+            return !failed;
         };
-        int tensor_count = 0;
-        int64_t t1       = ggml_time_ms();
+
         for (auto& tensor_storage : processed_tensor_storages) {
             if (tensor_storage.file_index != file_index) {
-                ++tensor_count;
                 continue;
             }
+            if (batch_pending && on_batch_full_cb && on_batch_full_cb(tensor_storage)) {
+                success = load_batch() && on_batch_loaded_cb();
+                if (!success) {
+                    break;
+                }
+                batch_pending = false;
+            }
             ggml_tensor* dst_tensor = NULL;
 
             success = on_new_tensor_cb(tensor_storage, &dst_tensor);
@@ -1793,76 +2039,13 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
             }
 
             if (dst_tensor == NULL) {
-                ++tensor_count;
                 continue;
             }
-
-            size_t nbytes_to_read = tensor_storage.nbytes_to_read();
-
-            if (dst_tensor->buffer == NULL || ggml_backend_buffer_is_host(dst_tensor->buffer)) {
-                // for the CPU and Metal backend, we can copy directly into the tensor
-                if (tensor_storage.type == dst_tensor->type) {
-                    GGML_ASSERT(ggml_nbytes(dst_tensor) == tensor_storage.nbytes());
-                    read_data(tensor_storage, (char*)dst_tensor->data, nbytes_to_read);
-
-                    if (tensor_storage.is_bf16) {
-                        // inplace op
-                        bf16_to_f32_vec((uint16_t*)dst_tensor->data, (float*)dst_tensor->data, tensor_storage.nelements());
-                    } else if (tensor_storage.is_f8_e4m3) {
-                        // inplace op
-                        f8_e4m3_to_f16_vec((uint8_t*)dst_tensor->data, (uint16_t*)dst_tensor->data, tensor_storage.nelements());
-                    } else if (tensor_storage.is_f8_e5m2) {
-                        // inplace op
-                        f8_e5m2_to_f16_vec((uint8_t*)dst_tensor->data, (uint16_t*)dst_tensor->data, tensor_storage.nelements());
-                    }
-                } else {
-                    read_buffer.resize(tensor_storage.nbytes());
-                    read_data(tensor_storage, (char*)read_buffer.data(), nbytes_to_read);
-
-                    if (tensor_storage.is_bf16) {
-                        // inplace op
-                        bf16_to_f32_vec((uint16_t*)read_buffer.data(), (float*)read_buffer.data(), tensor_storage.nelements());
-                    } else if (tensor_storage.is_f8_e4m3) {
-                        // inplace op
-                        f8_e4m3_to_f16_vec((uint8_t*)read_buffer.data(), (uint16_t*)read_buffer.data(), tensor_storage.nelements());
-                    } else if (tensor_storage.is_f8_e5m2) {
-                        // inplace op
-                        f8_e5m2_to_f16_vec((uint8_t*)read_buffer.data(), (uint16_t*)read_buffer.data(), tensor_storage.nelements());
-                    }
-
-                    convert_tensor((void*)read_buffer.data(), tensor_storage.type, dst_tensor->data,
-                                   dst_tensor->type, (int)tensor_storage.nelements() / (int)tensor_storage.ne[0], (int)tensor_storage.ne[0]);
-                }
-            } else {
-                read_buffer.resize(tensor_storage.nbytes());
-                read_data(tensor_storage, (char*)read_buffer.data(), nbytes_to_read);
-
-                if (tensor_storage.is_bf16) {
-                    // inplace op
-                    bf16_to_f32_vec((uint16_t*)read_buffer.data(), (float*)read_buffer.data(), tensor_storage.nelements());
-                } else if (tensor_storage.is_f8_e4m3) {
-                    // inplace op
-                    f8_e4m3_to_f16_vec((uint8_t*)read_buffer.data(), (uint16_t*)read_buffer.data(), tensor_storage.nelements());
-                } else if (tensor_storage.is_f8_e5m2) {
-                    // inplace op
-                    f8_e5m2_to_f16_vec((uint8_t*)read_buffer.data(), (uint16_t*)read_buffer.data(), tensor_storage.nelements());
-                }
-
-                if (tensor_storage.type == dst_tensor->type) {
-                    // copy to device memory
-                    ggml_backend_tensor_set(dst_tensor, read_buffer.data(), 0, ggml_nbytes(dst_tensor));
-                } else {
-                    // convert first, then copy to device memory
-                    convert_buffer.resize(ggml_nbytes(dst_tensor));
-                    convert_tensor((void*)read_buffer.data(), tensor_storage.type,
-                                   (void*)convert_buffer.data(), dst_tensor->type,
-                                   (int)tensor_storage.nelements() / (int)tensor_storage.ne[0], (int)tensor_storage.ne[0]);
-                    ggml_backend_tensor_set(dst_tensor, convert_buffer.data(), 0, ggml_nbytes(dst_tensor));
-                }
-            }
-            int64_t t2 = ggml_time_ms();
-            pretty_progress(++tensor_count, processed_tensor_storages.size(), (t2 - t1) / 1000.0f);
-            t1 = t2;
+            tensors_to_load.push_back({&tensor_storage, dst_tensor});
+            batch_pending = true;
+        }
+        if (success) {
+            success = load_batch();
         }
 
         if (zip != NULL) {
@@ -1873,12 +2056,16 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
             break;
         }
     }
+    if (success && on_batch_loaded_cb && batch_pending) {
+        success = on_batch_loaded_cb();
+    }
     return success;
 }
 
 bool ModelLoader::load_tensors(std::map<std::string, struct ggml_tensor*>& tensors,
                                ggml_backend_t backend,
-                               std::set<std::string> ignore_tensors) {
+                               std::set<std::string> ignore_tensors,
+                               int n_threads) {
     std::set<std::string> tensor_names_in_file;
     auto on_new_tensor_cb = [&](const TensorStorage& tensor_storage, ggml_tensor** dst_tensor) -> bool {
         const std::string& name = tensor_storage.name;
@@ -1917,7 +2104,7 @@ bool ModelLoader::load_tensors(std::map<std::string, struct ggml_tensor*>& tenso
         return true;
     };
 
-    bool success = load_tensors(on_new_tensor_cb, backend);
+    bool success = load_tensors(on_new_tensor_cb, backend, n_threads);
     if (!success) {
         LOG_ERROR("load tensors from file failed");
         return false;
@@ -1978,15 +2165,17 @@ bool ModelLoader::tensor_should_be_converted(const TensorStorage& tensor_storage
 }
 
 bool ModelLoader::save_to_gguf_file(const std::string& file_path, ggml_type type) {
-    auto backend    = ggml_backend_cpu_init();
+    // only the tensor infos live in the context, the data goes through a fixed size buffer
     size_t mem_size = 1 * 1024 * 1024;  // for padding
     mem_size += tensor_storages.size() * ggml_tensor_overhead();
-    mem_size += get_params_mem_size(backend, type);
-    LOG_INFO("model tensors mem size: %.2fMB", mem_size / 1024.f / 1024.f);
-    ggml_context* ggml_ctx = ggml_init({mem_size, NULL, false});
+    ggml_context* ggml_ctx = ggml_init({mem_size, NULL, true});
 
     gguf_context* gguf_ctx = gguf_init_empty();
 
+    // tensors in the order they are added to the gguf file, which is also the order
+    // load_tensors() hands them to the callback
+    std::vector<ggml_tensor*> tensors;
+
     auto on_new_tensor_cb = [&](const TensorStorage& tensor_storage, ggml_tensor** dst_tensor) -> bool {
         const std::string& name = tensor_storage.name;
 
@@ -2002,25 +2191,91 @@ bool ModelLoader::save_to_gguf_file(const std::string& file_path, ggml_type type
         }
         ggml_set_name(tensor, name.c_str());
 
-        // LOG_DEBUG("%s %d %s %d[%d %d %d %d] %d[%d %d %d %d]", name.c_str(),
-        // ggml_nbytes(tensor), ggml_type_name(tensor_type),
-        // tensor_storage.n_dims,
-        // tensor_storage.ne[0], tensor_storage.ne[1], tensor_storage.ne[2], tensor_storage.ne[3],
-        // tensor->n_dims, tensor->ne[0], tensor->ne[1], tensor->ne[2], tensor->ne[3]);
-
-        *dst_tensor = tensor;
-
         gguf_add_tensor(gguf_ctx, tensor);
+        tensors.push_back(tensor);
 
         return true;
     };
 
-    bool success = load_tensors(on_new_tensor_cb, backend);
-    ggml_backend_free(backend);
-    LOG_INFO("load tensors done");
+    bool success = load_tensors(on_new_tensor_cb, NULL);
+    if (!success) {
+        ggml_free(ggml_ctx);
+        gguf_free(gguf_ctx);
+        return false;
+    }
+
     LOG_INFO("trying to save tensors to %s", file_path.c_str());
+    FILE* fp = fopen(file_path.c_str(), "wb");
+    if (fp == NULL) {
+        LOG_ERROR("failed to open '%s'", file_path.c_str());
+        ggml_free(ggml_ctx);
+        gguf_free(gguf_ctx);
+        return false;
+    }
+
+    // header and tensor infos first, the offsets in there were fixed by gguf_add_tensor
+    std::vector<uint8_t> meta(gguf_get_meta_size(gguf_ctx));
+    gguf_get_meta_data(gguf_ctx, meta.data());
+    success = fwrite(meta.data(), 1, meta.size(), fp) == meta.size();
+
+    // then the data, a group of tensors at a time: load_tensors() reads and converts the group
+    // in parallel into the buffer, which is appended to the file before the next group
+    const size_t max_buffer_size = 512 * 1024 * 1024;
+    const size_t alignment       = gguf_get_alignment(gguf_ctx);
+    size_t buffer_size           = max_buffer_size;
+    for (auto tensor : tensors) {
+        buffer_size = std::max(buffer_size, GGML_PAD(ggml_nbytes(tensor), alignment));
+    }
+    std::vector<uint8_t> buffer(buffer_size);
+
+    size_t index    = 0;  // next tensor, load_tensors() hands them out in the same order again
+    size_t offset   = 0;  // end of the group in the buffer
+    size_t n_groups = 0;
+
+    auto on_batch_full_cb = [&](const TensorStorage& tensor_storage) -> bool {
+        return index < tensors.size() && offset + GGML_PAD(ggml_nbytes(tensors[index]), alignment) > buffer_size;
+    };
+
+    auto on_batch_loaded_cb = [&]() -> bool {
+        // the padding after each tensor is part of the buffer and already zeroed
+        bool ok = fwrite(buffer.data(), 1, offset, fp) == offset;
+        memset(buffer.data(), 0, offset);
+        offset = 0;
+        n_groups++;
+        return ok;
+    };
+
+    auto on_load_tensor_cb = [&](const TensorStorage& tensor_storage, ggml_tensor** dst_tensor) -> bool {
+        if (index >= tensors.size() || tensor_storage.name != ggml_get_name(tensors[index])) {
+            LOG_ERROR("tensor list changed while saving '%s'", file_path.c_str());
+            return false;
+        }
+        ggml_tensor* tensor = tensors[index++];
+        tensor->data        = buffer.data() + offset;
+        offset += GGML_PAD(ggml_nbytes(tensor), alignment);
+        *dst_tensor = tensor;
+        return true;
+    };
+
     if (success) {
-        gguf_write_to_file(gguf_ctx, file_path.c_str(), false);
+        success = load_tensors(on_load_tensor_cb, NULL, 0, on_batch_full_cb, on_batch_loaded_cb);
+    }
+    if (success && index != tensors.size()) {
+        LOG_ERROR("tensor list changed while saving '%s'", file_path.c_str());
+        success = false;
+    }
+    for (auto tensor : tensors) {
+        tensor->data = NULL;
+    }
+
+    if (fclose(fp) != 0) {
+        success = false;
+    }
+    if (success) {
+        LOG_INFO("saved %zu tensors in %zu groups", tensors.size(), n_groups);
+    } else {
+        LOG_ERROR("failed to save tensors to '%s'", file_path.c_str());
+        remove(file_path.c_str());
     }
     ggml_free(ggml_ctx);
     gguf_free(gguf_ctx);
@@ -188,6 +188,10 @@ struct TensorStorage {
 };
 
 typedef std::function<bool(const TensorStorage&, ggml_tensor**)> on_new_tensor_cb_t;
+// asked before each tensor whether the destinations handed out so far have to be loaded first
+typedef std::function<bool(const TensorStorage&)> on_batch_full_cb_t;
+// called once they are, false stops the loading
+typedef std::function<bool()> on_batch_loaded_cb_t;
 
 class ModelLoader {
 protected:
@@ -216,10 +220,19 @@ public:
     ggml_type get_diffusion_model_wtype();
     ggml_type get_vae_wtype();
     void set_wtype_override(ggml_type wtype, std::string prefix = "");
-    bool load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend_t backend);
+    // n_threads <= 0 uses all physical cores for reading and converting. With on_batch_full_cb the
+    // tensors are loaded in batches, so a caller can reuse the memory of its destinations: the
+    // batch is loaded and passed to on_batch_loaded_cb when on_batch_full_cb says the next tensor
+    // doesn't fit anymore, and once more after the last tensor.
+    bool load_tensors(on_new_tensor_cb_t on_new_tensor_cb,
+                      ggml_backend_t backend,
+                      int n_threads                           = 0,
+                      on_batch_full_cb_t on_batch_full_cb     = nullptr,
+                      on_batch_loaded_cb_t on_batch_loaded_cb = nullptr);
     bool load_tensors(std::map<std::string, struct ggml_tensor*>& tensors,
                       ggml_backend_t backend,
-                      std::set<std::string> ignore_tensors = {});
+                      std::set<std::string> ignore_tensors = {},
+                      int n_threads                        = 0);
 
     bool save_to_gguf_file(const std::string& file_path, ggml_type type);
     bool tensor_should_be_converted(const TensorStorage& tensor_storage, ggml_type type);
@@ -228,6 +241,7 @@ public:
 
     static std::string load_merges();
     static std::string load_t5_tokenizer_json();
+    static std::pair<const uint32_t*, size_t> load_t5_tokenizer_bin();
 };
 
 #endif  // __MODEL_H__
@@ -1,13 +1,22 @@
 #ifndef __RNG_H__
 #define __RNG_H__
 
+#include <assert.h>
+#include <memory>
 #include <random>
 #include <vector>
 
 class RNG {
 public:
-    virtual void manual_seed(uint64_t seed)      = 0;
-    virtual std::vector<float> randn(uint32_t n) = 0;
+    virtual void manual_seed(uint64_t seed) = 0;
+    // fills out[0, n) with samples of N(0, 1)
+    virtual void randn(float* out, uint32_t n) = 0;
+
+    std::vector<float> randn(uint32_t n) {
+        std::vector<float> result(n);
+        randn(result.data(), n);
+        return result;
+    }
 };
 
 class STDDefaultRNG : public RNG {
@@ -19,16 +28,45 @@ public:
         generator.seed((unsigned int)seed);
     }
 
-    std::vector<float> randn(uint32_t n) {
-        std::vector<float> result;
+    using RNG::randn;
+
+    void randn(float* out, uint32_t n) {
         float mean   = 0.0;
         float stddev = 1.0;
         std::normal_distribution<float> distribution(mean, stddev);
         for (uint32_t i = 0; i < n; i++) {
-            float random_number = distribution(generator);
-            result.push_back(random_number);
+            out[i] = distribution(generator);
+        }
+    }
+};
+
+// Draws every sample of a batch from its own generator.
+// randn(n) is split into rngs.size() equal chunks, chunk i coming from rngs[i],
+// which matches the layout of a [N, C, H, W] tensor. Sampling a batch with this
+// gives the same numbers as sampling each seed on its own.
+class BatchRNG : public RNG {
+private:
+    std::vector<std::shared_ptr<RNG>> rngs;
+
+public:
+    BatchRNG(const std::vector<std::shared_ptr<RNG>>& rngs)
+        : rngs(rngs) {}
+
+    // sample i is seeded with seed + i, like consecutive images of a batch
+    void manual_seed(uint64_t seed) {
+        for (size_t i = 0; i < rngs.size(); i++) {
+            rngs[i]->manual_seed(seed + i);
+        }
+    }
+
+    using RNG::randn;
+
+    void randn(float* out, uint32_t n) {
+        assert(rngs.size() > 0 && n % rngs.size() == 0);
+        uint32_t chunk = n / (uint32_t)rngs.size();
+        for (size_t i = 0; i < rngs.size(); i++) {
+            rngs[i]->randn(out + i * chunk, chunk);
         }
-        return result;
     }
 };
 
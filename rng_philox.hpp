@@ -1,6 +1,7 @@
 #ifndef __RNG_PHILOX_H__
 #define __RNG_PHILOX_H__
 
+#include <algorithm>
 #include <cmath>
 #include <vector>
 
@@ -14,67 +15,28 @@ private:
     uint32_t offset;
 
 private:
-    std::vector<uint32_t> philox_m = {0xD2511F53, 0xCD9E8D57};
-    std::vector<uint32_t> philox_w = {0x9E3779B9, 0xBB67AE85};
-    float two_pow32_inv            = 2.3283064e-10f;
-    float two_pow32_inv_2pi        = 2.3283064e-10f * 6.2831855f;
-
-    std::vector<uint32_t> uint32(uint64_t x) {
-        std::vector<uint32_t> result(2);
-        result[0] = static_cast<uint32_t>(x & 0xFFFFFFFF);
-        result[1] = static_cast<uint32_t>(x >> 32);
-        return result;
-    }
-
-    std::vector<std::vector<uint32_t>> uint32(const std::vector<uint64_t>& x) {
-        uint32_t N = (uint32_t)x.size();
-        std::vector<std::vector<uint32_t>> result(2, std::vector<uint32_t>(N));
-
-        for (uint32_t i = 0; i < N; ++i) {
-            result[0][i] = static_cast<uint32_t>(x[i] & 0xFFFFFFFF);
-            result[1][i] = static_cast<uint32_t>(x[i] >> 32);
-        }
-
-        return result;
-    }
-
-    //  A single round of the Philox 4x32 random number generator.
-    void philox4_round(std::vector<std::vector<uint32_t>>& counter,
-                       const std::vector<std::vector<uint32_t>>& key) {
-        uint32_t N = (uint32_t)counter[0].size();
-        for (uint32_t i = 0; i < N; i++) {
-            std::vector<uint32_t> v1 = uint32(static_cast<uint64_t>(counter[0][i]) * static_cast<uint64_t>(philox_m[0]));
-            std::vector<uint32_t> v2 = uint32(static_cast<uint64_t>(counter[2][i]) * static_cast<uint64_t>(philox_m[1]));
-
-            counter[0][i] = v2[1] ^ counter[1][i] ^ key[0][i];
-            counter[1][i] = v2[0];
-            counter[2][i] = v1[1] ^ counter[3][i] ^ key[1][i];
-            counter[3][i] = v1[0];
-        }
-    }
+    static const uint32_t philox_m0 = 0xD2511F53;
+    static const uint32_t philox_m1 = 0xCD9E8D57;
+    static const uint32_t philox_w0 = 0x9E3779B9;
+    static const uint32_t philox_w1 = 0xBB67AE85;
+    // lanes generated together, sized so the rounds below vectorize
+    static const uint32_t block_size = 256;
+
+    float two_pow32_inv     = 2.3283064e-10f;
+    float two_pow32_inv_2pi = 2.3283064e-10f * 6.2831855f;
+
+    // A single round of the Philox 4x32 random number generator over n lanes sharing one key.
+    static void philox4_round(uint32_t* c0, uint32_t* c1, uint32_t* c2, uint32_t* c3,
+                              uint32_t k0, uint32_t k1, uint32_t n) {
+        for (uint32_t i = 0; i < n; i++) {
+            uint64_t v1 = static_cast<uint64_t>(c0[i]) * philox_m0;
+            uint64_t v2 = static_cast<uint64_t>(c2[i]) * philox_m1;
 
-    // Generates 32-bit random numbers using the Philox 4x32 random number generator.
-    // Parameters:
-    //     counter : A 4xN array of 32-bit integers representing the counter values (offset into generation).
-    //     key : A 2xN array of 32-bit integers representing the key values (seed).
-    //     rounds : The number of rounds to perform.
-    // Returns:
-    //     std::vector<std::vector<uint32_t>>: A 4xN array of 32-bit integers containing the generated random numbers.
-    std::vector<std::vector<uint32_t>> philox4_32(std::vector<std::vector<uint32_t>>& counter,
-                                                  std::vector<std::vector<uint32_t>>& key,
-                                                  int rounds = 10) {
-        uint32_t N = (uint32_t)counter[0].size();
-        for (int i = 0; i < rounds - 1; ++i) {
-            philox4_round(counter, key);
-
-            for (uint32_t j = 0; j < N; ++j) {
-                key[0][j] += philox_w[0];
-                key[1][j] += philox_w[1];
-            }
+            c0[i] = static_cast<uint32_t>(v2 >> 32) ^ c1[i] ^ k0;
+            c1[i] = static_cast<uint32_t>(v2);
+            c2[i] = static_cast<uint32_t>(v1 >> 32) ^ c3[i] ^ k1;
+            c3[i] = static_cast<uint32_t>(v1);
         }
-
-        philox4_round(counter, key);
-        return counter;
     }
 
     float box_muller(float x, float y) {
@@ -98,27 +60,35 @@ public:
         this->offset = 0;
     }
 
-    std::vector<float> randn(uint32_t n) {
-        std::vector<std::vector<uint32_t>> counter(4, std::vector<uint32_t>(n, 0));
-        for (uint32_t i = 0; i < n; i++) {
-            counter[0][i] = this->offset;
-        }
-
-        for (uint32_t i = 0; i < n; i++) {
-            counter[2][i] = i;
-        }
-        this->offset += 1;
-
-        std::vector<uint64_t> key(n, this->seed);
-        std::vector<std::vector<uint32_t>> key_uint32 = uint32(key);
+    using RNG::randn;
+
+    // Sample i is Philox4x32-10 of the counter (offset, 0, i, 0) keyed by the seed,
+    // only the first two words are used.
+    void randn(float* out, uint32_t n) {
+        uint32_t c0[block_size], c1[block_size], c2[block_size], c3[block_size];
+        for (uint32_t begin = 0; begin < n; begin += block_size) {
+            uint32_t len = std::min<uint32_t>((uint32_t)block_size, n - begin);
+            for (uint32_t i = 0; i < len; i++) {
+                c0[i] = this->offset;
+                c1[i] = 0;
+                c2[i] = begin + i;
+                c3[i] = 0;
+            }
 
-        std::vector<std::vector<uint32_t>> g = philox4_32(counter, key_uint32);
+            uint32_t k0 = static_cast<uint32_t>(this->seed & 0xFFFFFFFF);
+            uint32_t k1 = static_cast<uint32_t>(this->seed >> 32);
+            for (int round = 0; round < 9; round++) {
+                philox4_round(c0, c1, c2, c3, k0, k1, len);
+                k0 += philox_w0;
+                k1 += philox_w1;
+            }
+            philox4_round(c0, c1, c2, c3, k0, k1, len);
 
-        std::vector<float> result;
-        for (uint32_t i = 0; i < n; ++i) {
-            result.push_back(box_muller((float)g[0][i], (float)g[1][i]));
+            for (uint32_t i = 0; i < len; i++) {
+                out[begin + i] = box_muller((float)c0[i], (float)c1[i]);
+            }
         }
-        return result;
+        this->offset += 1;
     }
 };
 
@@ -85,6 +85,7 @@ public:
     bool free_params_immediately = false;
 
     std::shared_ptr<RNG> rng = std::make_shared<STDDefaultRNG>();
+    rng_type_t rng_type      = STD_DEFAULT_RNG;
     int n_threads            = -1;
     float scale_factor       = 0.18215f;
 
@@ -102,12 +103,38 @@ public:
     bool use_tiny_autoencoder = false;
     bool vae_tiling           = false;
     bool stacked_id           = false;
+    bool batch_sampling       = false;
+    bool fused_cfg            = false;
+    int vae_tile_batch        = 1;
 
     std::map<std::string, struct ggml_tensor*> tensors;
 
     std::string lora_model_dir;
     // lora_name => multiplier
     std::unordered_map<std::string, float> curr_lora_state;
+    // loaded LoRAs kept around for the next prompts, most recently used first
+    int lora_cache_size = 0;
+    std::list<std::pair<std::string, std::shared_ptr<LoraModel>>> lora_cache;
+    // LoRAs of the diffusion model applied in the forward pass instead of being merged
+    bool runtime_lora = false;
+    std::set<struct ggml_tensor*> runtime_lora_targets;
+    std::vector<std::shared_ptr<LoraModel>> runtime_lora_models;
+    // keep the latent and the sampler state on the backend between steps
+    bool sampler_on_backend = false;
+
+    // text conditions of recent prompts, most recently used first
+    struct CachedCondition {
+        std::string key;
+        std::vector<float> c_crossattn;
+        std::vector<float> c_vector;
+        int64_t ne_crossattn[4];
+        int64_t ne_vector[4];
+    };
+    size_t cond_cache_max_bytes = 0;
+    size_t cond_cache_bytes     = 0;
+    uint64_t cond_cache_hits    = 0;
+    uint64_t cond_cache_misses  = 0;
+    std::list<CachedCondition> cond_cache;
 
     std::shared_ptr<Denoiser> denoiser = std::make_shared<CompVisDenoiser>();
 
@@ -121,12 +148,60 @@ public:
         : n_threads(n_threads),
           vae_decode_only(vae_decode_only),
           free_params_immediately(free_params_immediately),
-          lora_model_dir(lora_model_dir) {
-        if (rng_type == STD_DEFAULT_RNG) {
-            rng = std::make_shared<STDDefaultRNG>();
-        } else if (rng_type == CUDA_RNG) {
-            rng = std::make_shared<PhiloxRNG>();
+          lora_model_dir(lora_model_dir),
+          rng_type(rng_type) {
+        rng = new_rng();
+    }
+
+    std::shared_ptr<RNG> new_rng() {
+        if (rng_type == CUDA_RNG) {
+            return std::make_shared<PhiloxRNG>();
+        }
+        return std::make_shared<STDDefaultRNG>();
+    }
+
+    // only UNet models handle N > 1 in a single diffusion graph for now
+    bool diffusion_model_supports_batch() {
+        return !sd_version_is_dit(version) && version != VERSION_SVD;
+    }
+
+    bool can_batch_sampling(ggml_tensor* control_hint) {
+        return diffusion_model_supports_batch() && control_hint == NULL;
+    }
+
+    static bool can_stack_cfg_tensor(ggml_tensor* a, ggml_tensor* b) {
+        if (a == NULL || b == NULL) {
+            return a == b;
+        }
+        return ggml_are_same_shape(a, b) && a->type == GGML_TYPE_F32 && b->type == GGML_TYPE_F32;
+    }
+
+    // cond and uncond can share one graph when their tensors only differ in values
+    bool can_fuse_cfg(const SDCondition& cond, const SDCondition& uncond, ggml_tensor* control_hint) {
+        if (!fused_cfg || !diffusion_model_supports_batch() || control_hint != NULL) {
+            return false;
+        }
+        return can_stack_cfg_tensor(cond.c_crossattn, uncond.c_crossattn) &&
+               can_stack_cfg_tensor(cond.c_vector, uncond.c_vector) &&
+               can_stack_cfg_tensor(cond.c_concat, uncond.c_concat);
+    }
+
+    // same for the control net, which doesn't read c_concat
+    bool can_batch_control(const SDCondition& cond, const SDCondition& uncond) {
+        return can_stack_cfg_tensor(cond.c_crossattn, uncond.c_crossattn) &&
+               can_stack_cfg_tensor(cond.c_vector, uncond.c_vector);
+    }
+
+    SDCondition stack_cfg_condition(ggml_context* work_ctx, const SDCondition& cond, const SDCondition& uncond, int64_t n) {
+        SDCondition fused;
+        fused.c_crossattn = ggml_tensor_stack_batch(work_ctx, cond.c_crossattn, uncond.c_crossattn, n, 2);
+        if (cond.c_vector != NULL) {
+            fused.c_vector = ggml_tensor_stack_batch(work_ctx, cond.c_vector, uncond.c_vector, n, 1);
         }
+        if (cond.c_concat != NULL) {
+            fused.c_concat = ggml_tensor_stack_batch(work_ctx, cond.c_concat, uncond.c_concat, n, 3);
+        }
+        return fused;
     }
 
     ~StableDiffusionGGML() {
@@ -449,7 +524,7 @@ public:
         if (version == VERSION_SVD) {
             ignore_tensors.insert("conditioner.embedders.3");
         }
-        bool success = model_loader.load_tensors(tensors, backend, ignore_tensors);
+        bool success = model_loader.load_tensors(tensors, backend, ignore_tensors, n_threads);
         if (!success) {
             LOG_ERROR("load tensors from model loader failed");
             ggml_free(ctx);
@@ -533,6 +608,7 @@ public:
 
         int64_t t1 = ggml_time_ms();
         LOG_INFO("loading model from '%s' completed, taking %.2fs", model_path.c_str(), (t1 - t0) * 1.0f / 1000);
+        sd_profile_stage("load_model", (int64_t)(t1 - t0) * 1000);
 
         // check is_using_v_parameterization_for_sd2
         bool is_using_v_parameterization = false;
@@ -651,37 +727,229 @@ public:
         return result < -1;
     }
 
-    void apply_lora(const std::string& lora_name, float multiplier) {
-        int64_t t0                 = ggml_time_ms();
+    std::shared_ptr<LoraModel> load_lora(const std::string& file_path) {
+        for (auto it = lora_cache.begin(); it != lora_cache.end(); it++) {
+            if (it->first == file_path) {
+                LOG_DEBUG("lora cache hit: %s", file_path.c_str());
+                lora_cache.splice(lora_cache.begin(), lora_cache, it);
+                return lora_cache.front().second;
+            }
+        }
+
+        auto lora = std::make_shared<LoraModel>(backend, file_path);
+        if (!lora->load_from_file()) {
+            LOG_WARN("load lora tensors from %s failed", file_path.c_str());
+            return nullptr;
+        }
+        if (lora_cache_size > 0) {
+            lora_cache.emplace_front(file_path, lora);
+            while (lora_cache.size() > (size_t)lora_cache_size) {
+                LOG_DEBUG("lora cache evict: %s", lora_cache.back().first.c_str());
+                lora_cache.pop_back();
+            }
+        }
+        return lora;
+    }
+
+    static size_t get_cached_condition_bytes(const CachedCondition& cached) {
+        return (cached.c_crossattn.size() + cached.c_vector.size()) * sizeof(float) + cached.key.size();
+    }
+
+    // The text encoders only see the prompt, clip_skip, the image size (sdxl),
+    // the embeddings (fixed per context) and the LoRAs merged into them. The prompt is
+    // used as is, the T5 tokenizer keeps whitespace that CLIP would collapse.
+    std::string get_condition_cache_key(const std::string& text,
+                                        int clip_skip,
+                                        int width,
+                                        int height,
+                                        bool force_zero_embeddings) {
+        std::string key = text;
+        key += format("|%d|%dx%d|%d", clip_skip, width, height, force_zero_embeddings ? 1 : 0);
+        std::map<std::string, float> loras(curr_lora_state.begin(), curr_lora_state.end());
+        for (auto& kv : loras) {
+            key += format("|%s:%g", kv.first.c_str(), kv.second);
+        }
+        return key;
+    }
+
+    SDCondition get_learned_condition(ggml_context* work_ctx,
+                                      const std::string& text,
+                                      int clip_skip,
+                                      int width,
+                                      int height,
+                                      bool force_zero_embeddings = false) {
+        if (cond_cache_max_bytes == 0) {
+            return cond_stage_model->get_learned_condition(work_ctx, n_threads, text, clip_skip, width, height,
+                                                           diffusion_model->get_adm_in_channels(), force_zero_embeddings);
+        }
+
+        std::string key = get_condition_cache_key(text, clip_skip, width, height, force_zero_embeddings);
+        for (auto it = cond_cache.begin(); it != cond_cache.end(); it++) {
+            if (it->key != key) {
+                continue;
+            }
+            cond_cache.splice(cond_cache.begin(), cond_cache, it);
+            cond_cache_hits++;
+            LOG_DEBUG("condition cache hit (%" PRIu64 " hits, %" PRIu64 " misses)", cond_cache_hits, cond_cache_misses);
+
+            const CachedCondition& cached = cond_cache.front();
+            SDCondition cond;
+            if (cached.c_crossattn.size() > 0) {
+                cond.c_crossattn = ggml_new_tensor(work_ctx, GGML_TYPE_F32, 4, cached.ne_crossattn);
+                memcpy(cond.c_crossattn->data, cached.c_crossattn.data(), ggml_nbytes(cond.c_crossattn));
+            }
+            if (cached.c_vector.size() > 0) {
+                cond.c_vector = ggml_new_tensor(work_ctx, GGML_TYPE_F32, 4, cached.ne_vector);
+                memcpy(cond.c_vector->data, cached.c_vector.data(), ggml_nbytes(cond.c_vector));
+            }
+            return cond;
+        }
+
+        cond_cache_misses++;
+        LOG_DEBUG("condition cache miss (%" PRIu64 " hits, %" PRIu64 " misses)", cond_cache_hits, cond_cache_misses);
+        SDCondition cond = cond_stage_model->get_learned_condition(work_ctx, n_threads, text, clip_skip, width, height,
+                                                                   diffusion_model->get_adm_in_channels(), force_zero_embeddings);
+        auto cacheable = [](ggml_tensor* t) {
+            return t == NULL || (t->type == GGML_TYPE_F32 && ggml_is_contiguous(t));
+        };
+        if (cond.c_concat != NULL || !cacheable(cond.c_crossattn) || !cacheable(cond.c_vector)) {
+            return cond;
+        }
+
+        CachedCondition cached;
+        cached.key = key;
+        if (cond.c_crossattn != NULL) {
+            float* data = (float*)cond.c_crossattn->data;
+            cached.c_crossattn.assign(data, data + ggml_nelements(cond.c_crossattn));
+            memcpy(cached.ne_crossattn, cond.c_crossattn->ne, sizeof(cached.ne_crossattn));
+        }
+        if (cond.c_vector != NULL) {
+            float* data = (float*)cond.c_vector->data;
+            cached.c_vector.assign(data, data + ggml_nelements(cond.c_vector));
+            memcpy(cached.ne_vector, cond.c_vector->ne, sizeof(cached.ne_vector));
+        }
+        size_t bytes = get_cached_condition_bytes(cached);
+        if (bytes > cond_cache_max_bytes) {
+            return cond;
+        }
+        while (cond_cache_bytes + bytes > cond_cache_max_bytes) {
+            cond_cache_bytes -= get_cached_condition_bytes(cond_cache.back());
+            cond_cache.pop_back();
+        }
+        cond_cache_bytes += bytes;
+        cond_cache.push_front(std::move(cached));
+        return cond;
+    }
+
+    std::string get_lora_file_path(const std::string& lora_name) {
         std::string st_file_path   = path_join(lora_model_dir, lora_name + ".safetensors");
         std::string ckpt_file_path = path_join(lora_model_dir, lora_name + ".ckpt");
-        std::string file_path;
         if (file_exists(st_file_path)) {
-            file_path = st_file_path;
+            return st_file_path;
         } else if (file_exists(ckpt_file_path)) {
-            file_path = ckpt_file_path;
-        } else {
-            LOG_WARN("can not find %s or %s for lora %s", st_file_path.c_str(), ckpt_file_path.c_str(), lora_name.c_str());
+            return ckpt_file_path;
+        }
+        LOG_WARN("can not find %s or %s for lora %s", st_file_path.c_str(), ckpt_file_path.c_str(), lora_name.c_str());
+        return "";
+    }
+
+    void apply_lora(const std::string& lora_name, float multiplier) {
+        int64_t t0            = ggml_time_ms();
+        std::string file_path = get_lora_file_path(lora_name);
+        if (file_path.empty()) {
             return;
         }
-        LoraModel lora(backend, file_path);
-        if (!lora.load_from_file()) {
-            LOG_WARN("load lora tensors from %s failed", file_path.c_str());
+        std::shared_ptr<LoraModel> lora = load_lora(file_path);
+        if (lora == nullptr) {
             return;
         }
 
-        lora.multiplier = multiplier;
+        lora->multiplier = multiplier;
         // TODO: send version?
-        lora.apply(tensors, version, n_threads);
-        lora.free_params_buffer();
+        lora->apply(tensors, version, n_threads);
+        if (lora_cache_size <= 0) {
+            lora->free_params_buffer();
+        }
 
         int64_t t1 = ggml_time_ms();
 
         LOG_INFO("lora '%s' applied, taking %.2fs", lora_name.c_str(), (t1 - t0) * 1.0f / 1000);
     }
 
+    void clear_runtime_loras() {
+        diffusion_model->get_runtime_lora_map()->clear();
+        runtime_lora_models.clear();
+    }
+
+    // The diffusion model weights covered by a plain up/down LoRA are left untouched and
+    // the LoRA is evaluated next to them, everything else is still merged.
+    void apply_runtime_loras(const std::unordered_map<std::string, float>& lora_state,
+                             const std::unordered_map<std::string, float>& lora_state_diff) {
+        if (runtime_lora_targets.empty()) {
+            diffusion_model->get_runtime_lora_targets(runtime_lora_targets);
+        }
+        std::vector<std::shared_ptr<LoraModel>> prev_runtime_lora_models = runtime_lora_models;
+        clear_runtime_loras();
+
+        for (auto& kv : lora_state_diff) {
+            int64_t t0                   = ggml_time_ms();
+            const std::string& lora_name = kv.first;
+            float diff                   = kv.second;
+            float multiplier             = 0.f;
+            if (lora_state.find(lora_name) != lora_state.end()) {
+                multiplier = lora_state.at(lora_name);
+            }
+            if (diff == 0.f && multiplier == 0.f) {
+                continue;
+            }
+
+            std::string file_path = get_lora_file_path(lora_name);
+            if (file_path.empty()) {
+                continue;
+            }
+            std::shared_ptr<LoraModel> lora;
+            for (auto& prev : prev_runtime_lora_models) {
+                if (prev->file_path == file_path) {
+                    lora = prev;
+                    break;
+                }
+            }
+            if (lora == nullptr) {
+                lora = load_lora(file_path);
+                if (lora == nullptr) {
+                    continue;
+                }
+            }
+
+            lora->multiplier                 = multiplier;
+            RuntimeLoraMap* runtime_lora_map = multiplier != 0.f ? diffusion_model->get_runtime_lora_map() : NULL;
+            std::set<std::string> taken      = lora->get_runtime_loras(tensors, runtime_lora_targets, version, runtime_lora_map);
+            if (diff != 0.f) {
+                std::map<std::string, struct ggml_tensor*> merge_tensors;
+                for (auto& t : tensors) {
+                    if (taken.find(t.first) == taken.end()) {
+                        merge_tensors[t.first] = t.second;
+                    }
+                }
+                lora->multiplier = diff;
+                lora->apply(merge_tensors, version, n_threads);
+            }
+            if (multiplier != 0.f && taken.size() > 0) {
+                runtime_lora_models.push_back(lora);
+            } else if (lora_cache_size <= 0) {
+                lora->free_params_buffer();
+            }
+
+            int64_t t1 = ggml_time_ms();
+            LOG_INFO("lora '%s' applied (%lu weights at runtime), taking %.2fs",
+                     lora_name.c_str(), taken.size(), (t1 - t0) * 1.0f / 1000);
+        }
+        // the cached diffusion graph was built against the previous LoRAs
+        diffusion_model->free_compute_buffer();
+    }
+
     void apply_loras(const std::unordered_map<std::string, float>& lora_state) {
-        if (lora_state.size() > 0 && model_wtype != GGML_TYPE_F16 && model_wtype != GGML_TYPE_F32) {
+        if (!runtime_lora && lora_state.size() > 0 && model_wtype != GGML_TYPE_F16 && model_wtype != GGML_TYPE_F32) {
             LOG_WARN("In quantized models when applying LoRA, the images have poor quality.");
         }
         std::unordered_map<std::string, float> lora_state_diff;
@@ -703,8 +971,16 @@ public:
             LOG_INFO("Attempting to apply %lu LoRAs", lora_state.size());
         }
 
-        for (auto& kv : lora_state_diff) {
-            apply_lora(kv.first, kv.second);
+        if (runtime_lora) {
+            apply_runtime_loras(lora_state, lora_state_diff);
+        } else {
+            for (auto& kv : lora_state_diff) {
+                if (kv.second == 0.f) {
+                    // same multiplier as the last prompt
+                    continue;
+                }
+                apply_lora(kv.first, kv.second);
+            }
         }
 
         curr_lora_state = lora_state;
@@ -770,7 +1046,7 @@ public:
                     free(resized_image.data);
                     resized_image.data = NULL;
                 } else {
-                    sd_image_to_tensor(init_image.data, init_img);
+                    sd_image_to_tensor(init_image.data, init_img, true, n_threads);
                 }
                 if (augmentation_level > 0.f) {
                     struct ggml_tensor* noise = ggml_dup_tensor(work_ctx, init_img);
@@ -818,7 +1094,8 @@ public:
                         float slg_scale                       = 0,
                         float skip_layer_start                = 0.01,
                         float skip_layer_end                  = 0.2,
-                        ggml_tensor* noise_mask               = nullptr) {
+                        ggml_tensor* noise_mask               = nullptr,
+                        std::shared_ptr<RNG> sample_rng       = nullptr) {
         LOG_DEBUG("Sample");
         struct ggml_init_params params;
         size_t data_size = ggml_row_size(init_latent->type, init_latent->ne[0]);
@@ -831,7 +1108,9 @@ public:
         params.no_alloc       = false;
         ggml_context* tmp_ctx = ggml_init(params);
 
-        size_t steps = sigmas.size() - 1;
+        size_t steps          = sigmas.size() - 1;
+        StepCache* step_cache = diffusion_model->get_step_cache();
+        step_cache->reset();
         // noise = load_tensor_from_file(work_ctx, "./rand0.bin");
         // print_ggml_tensor(noise);
         struct ggml_tensor* x = ggml_dup_tensor(work_ctx, init_latent);
@@ -861,6 +1140,41 @@ public:
         }
         struct ggml_tensor* denoised = ggml_dup_tensor(work_ctx, x);
 
+        // cond and uncond are evaluated together as a batch of 2 * N
+        // the id condition is only used with the c_concat of cond, see the denoise wrapper
+        SDCondition merge_cond(id_cond.c_crossattn, id_cond.c_vector, cond.c_concat);
+        bool fuse_cfg = has_unconditioned && can_fuse_cfg(cond, uncond, control_hint);
+        if (fuse_cfg && start_merge_step != -1) {
+            fuse_cfg = can_fuse_cfg(merge_cond, uncond, control_hint);
+        }
+        SDCondition fused_cond;
+        SDCondition fused_id_cond;
+        struct ggml_tensor* fused_input = NULL;
+        struct ggml_tensor* fused_out   = NULL;
+        if (fuse_cfg) {
+            int64_t n  = x->ne[3];
+            fused_cond = stack_cfg_condition(work_ctx, cond, uncond, n);
+            if (start_merge_step != -1) {
+                fused_id_cond = stack_cfg_condition(work_ctx, merge_cond, uncond, n);
+            }
+            fused_input = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, x->ne[0], x->ne[1], x->ne[2], 2 * n);
+            fused_out   = ggml_dup_tensor(work_ctx, fused_input);
+            LOG_DEBUG("cond and uncond are fused into a single graph");
+        }
+
+        // the controls of cond and uncond come from one control net pass over a batch of 2 * N
+        bool batch_control = control_hint != NULL && has_unconditioned && can_batch_control(cond, uncond);
+        SDCondition control_cond;
+        struct ggml_tensor* control_input = NULL;
+        if (batch_control) {
+            int64_t n                = x->ne[3];
+            control_cond.c_crossattn = ggml_tensor_stack_batch(work_ctx, cond.c_crossattn, uncond.c_crossattn, n, 2);
+            if (cond.c_vector != NULL) {
+                control_cond.c_vector = ggml_tensor_stack_batch(work_ctx, cond.c_vector, uncond.c_vector, n, 1);
+            }
+            control_input = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, x->ne[0], x->ne[1], x->ne[2], 2 * n);
+        }
+
         auto denoise = [&](ggml_tensor* input, float sigma, int step) -> ggml_tensor* {
             if (step == 1) {
                 pretty_progress(0, (int)steps, 0);
@@ -885,14 +1199,49 @@ public:
 
             std::vector<struct ggml_tensor*> controls;
 
-            if (control_hint != NULL) {
+            if (control_hint != NULL && batch_control) {
+                size_t half_size = ggml_nbytes(noised_input);
+                memcpy(control_input->data, noised_input->data, half_size);
+                memcpy((char*)control_input->data + half_size, noised_input->data, half_size);
+                std::vector<float> control_timesteps_vec(control_input->ne[3], t);
+                auto control_timesteps = vector_to_ggml_tensor(work_ctx, control_timesteps_vec);
+                control_net->compute(n_threads, control_input, control_hint, control_timesteps, control_cond.c_crossattn, control_cond.c_vector, true);
+                controls = control_net->controls;
+            } else if (control_hint != NULL) {
                 control_net->compute(n_threads, noised_input, control_hint, timesteps, cond.c_crossattn, cond.c_vector);
                 controls = control_net->controls;
                 // print_ggml_tensor(controls[12]);
                 // GGML_ASSERT(0);
             }
 
-            if (start_merge_step == -1 || step <= start_merge_step) {
+            float* negative_data = NULL;
+            if (fuse_cfg) {
+                size_t half_size = ggml_nbytes(noised_input);
+                memcpy(fused_input->data, noised_input->data, half_size);
+                memcpy((char*)fused_input->data + half_size, noised_input->data, half_size);
+
+                std::vector<float> fused_timesteps_vec(fused_input->ne[3], t);
+                auto fused_timesteps = vector_to_ggml_tensor(work_ctx, fused_timesteps_vec);
+                std::vector<float> fused_guidance_vec(fused_input->ne[3], guidance);
+                auto fused_guidance = vector_to_ggml_tensor(work_ctx, fused_guidance_vec);
+
+                const SDCondition& c = (start_merge_step == -1 || step <= start_merge_step) ? fused_cond : fused_id_cond;
+                diffusion_model->compute(n_threads,
+                                         fused_input,
+                                         fused_timesteps,
+                                         c.c_crossattn,
+                                         c.c_concat,
+                                         c.c_vector,
+                                         fused_guidance,
+                                         ref_latents,
+                                         -1,
+                                         {},
+                                         control_strength,
+                                         &fused_out);
+                memcpy(out_cond->data, fused_out->data, half_size);
+                memcpy(out_uncond->data, (char*)fused_out->data + half_size, half_size);
+                negative_data = (float*)out_uncond->data;
+            } else if (start_merge_step == -1 || step <= start_merge_step) {
                 // cond
                 diffusion_model->compute(n_threads,
                                          noised_input,
@@ -921,10 +1270,11 @@ public:
                                          &out_cond);
             }
 
-            float* negative_data = NULL;
-            if (has_unconditioned) {
+            if (has_unconditioned && !fuse_cfg) {
                 // uncond
-                if (control_hint != NULL) {
+                if (control_hint != NULL && batch_control) {
+                    controls = control_net->uncond_controls;
+                } else if (control_hint != NULL) {
                     control_net->compute(n_threads, noised_input, control_hint, timesteps, uncond.c_crossattn, uncond.c_vector);
                     controls = control_net->controls;
                 }
@@ -965,51 +1315,207 @@ public:
                                          skip_layers);
                 skip_layer_data = (float*)out_skip->data;
             }
+            // cfg, slg, denoiser scaling and inpaint blend in one pass over the rows of the latent
             float* vec_denoised  = (float*)denoised->data;
             float* vec_input     = (float*)input->data;
             float* positive_data = (float*)out_cond->data;
-            int ne_elements      = (int)ggml_nelements(denoised);
-            for (int i = 0; i < ne_elements; i++) {
-                float latent_result = positive_data[i];
-                if (has_unconditioned) {
-                    // out_uncond + cfg_scale * (out_cond - out_uncond)
-                    int64_t ne3 = out_cond->ne[3];
-                    if (min_cfg != cfg_scale && ne3 != 1) {
-                        int64_t i3  = i / out_cond->ne[0] * out_cond->ne[1] * out_cond->ne[2];
-                        float scale = min_cfg + (cfg_scale - min_cfg) * (i3 * 1.0f / ne3);
+            float* vec_init      = (float*)init_latent->data;
+            float* vec_mask      = noise_mask != nullptr ? (float*)noise_mask->data : NULL;
+            int64_t width        = denoised->ne[0];
+            int64_t height       = denoised->ne[1];
+            int64_t channels     = denoised->ne[2];
+            int64_t ne3          = denoised->ne[3];
+            std::vector<float> cfg_scales(ne3, cfg_scale);
+            if (min_cfg != cfg_scale && ne3 != 1) {
+                // svd: the scale ramps up over the frames
+                for (int64_t i3 = 0; i3 < ne3; i3++) {
+                    cfg_scales[i3] = min_cfg + (cfg_scale - min_cfg) * (i3 * 1.0f / ne3);
+                }
+            }
+            GGML_ASSERT(ggml_is_contiguous(denoised) && ggml_is_contiguous(input) && ggml_is_contiguous(init_latent));
+            GGML_ASSERT(vec_mask == NULL || (ggml_is_contiguous(noise_mask) && noise_mask->ne[0] == width && noise_mask->ne[1] == height));
+            // a few flops per value, only latents of several 256k values (video, large images) are split,
+            // the rest stays on this thread
+            int64_t rows_per_thread = std::max((int64_t)1, (256 * 1024) / width);
+            sd_parallel_for(n_threads, height * channels * ne3, rows_per_thread, [&](int64_t begin, int64_t end) {
+                for (int64_t row = begin; row < end; row++) {
+                    int64_t offset    = row * width;
+                    float scale       = cfg_scales[row / (height * channels)];
+                    float* denoised_i = vec_denoised + offset;
+                    const float* pos  = positive_data + offset;
+                    const float* in   = vec_input + offset;
+                    if (has_unconditioned) {
+                        // out_uncond + cfg_scale * (out_cond - out_uncond)
+                        const float* neg = negative_data + offset;
+                        for (int64_t i = 0; i < width; i++) {
+                            denoised_i[i] = neg[i] + scale * (pos[i] - neg[i]);
+                        }
                     } else {
-                        latent_result = negative_data[i] + cfg_scale * (positive_data[i] - negative_data[i]);
+                        memcpy(denoised_i, pos, width * sizeof(float));
+                    }
+                    if (is_skiplayer_step) {
+                        const float* skip = skip_layer_data + offset;
+                        for (int64_t i = 0; i < width; i++) {
+                            denoised_i[i] = denoised_i[i] + (pos[i] - skip[i]) * slg_scale;
+                        }
+                    }
+                    // v = latent_result, eps = latent_result
+                    // denoised = (v * c_out + input * c_skip) or (input + eps * c_out)
+                    for (int64_t i = 0; i < width; i++) {
+                        denoised_i[i] = denoised_i[i] * c_out + in[i] * c_skip;
+                    }
+                    if (vec_mask != NULL) {
+                        const float* mask = vec_mask + (row % height) * width;
+                        const float* init = vec_init + offset;
+                        for (int64_t i = 0; i < width; i++) {
+                            denoised_i[i] = init[i] + mask[i] * (denoised_i[i] - init[i]);
+                        }
                     }
                 }
-                if (is_skiplayer_step) {
-                    latent_result = latent_result + (positive_data[i] - skip_layer_data[i]) * slg_scale;
-                }
-                // v = latent_result, eps = latent_result
-                // denoised = (v * c_out + input * c_skip) or (input + eps * c_out)
-                vec_denoised[i] = latent_result * c_out + vec_input[i] * c_skip;
-            }
+            });
             int64_t t1 = ggml_time_us();
             if (step > 0) {
                 pretty_progress(step, (int)steps, (t1 - t0) / 1000000.f);
+                sd_profile_step(step, (int)steps, t1 - t0);
                 // LOG_INFO("step %d sampling completed taking %.2fs", step, (t1 - t0) * 1.0f / 1000000);
             }
+
+            return denoised;
+        };
+
+        bool sample_on_backend = sampler_on_backend && !ggml_backend_is_cpu(backend) && sampler_supports_backend(method) &&
+                                 control_hint == NULL && !fuse_cfg;
+        if (sample_on_backend) {
+            LOG_DEBUG("the sampler state stays on the backend");
+            SamplerRunner sampler(backend, n_threads);
+            ggml_tensor* noised_dev     = sampler.new_tensor(x);
+            ggml_tensor* out_cond_dev   = sampler.new_tensor(x);
+            ggml_tensor* out_uncond_dev = has_unconditioned ? sampler.new_tensor(x) : NULL;
+            ggml_tensor* out_skip_dev   = has_skiplayer ? sampler.new_tensor(x) : NULL;
+            ggml_tensor* denoised_dev   = sampler.new_tensor(x);
+            ggml_tensor* init_dev       = NULL;
+            ggml_tensor* mask_dev       = NULL;
+            ggml_tensor* cfg_scales_dev = NULL;
             if (noise_mask != nullptr) {
-                for (int64_t x = 0; x < denoised->ne[0]; x++) {
-                    for (int64_t y = 0; y < denoised->ne[1]; y++) {
-                        float mask = ggml_tensor_get_f32(noise_mask, x, y);
-                        for (int64_t k = 0; k < denoised->ne[2]; k++) {
-                            float init = ggml_tensor_get_f32(init_latent, x, y, k);
-                            float den  = ggml_tensor_get_f32(denoised, x, y, k);
-                            ggml_tensor_set_f32(denoised, init + mask * (den - init), x, y, k);
-                        }
-                    }
+                init_dev = sampler.new_tensor(init_latent, init_latent);
+                mask_dev = sampler.new_tensor(noise_mask, noise_mask);
+            }
+            if (has_unconditioned && min_cfg != cfg_scale && x->ne[3] != 1) {
+                // svd: the scale ramps up over the frames
+                ggml_tensor* cfg_scales = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, 1, 1, 1, x->ne[3]);
+                for (int64_t i3 = 0; i3 < x->ne[3]; i3++) {
+                    ggml_tensor_set_f32(cfg_scales, min_cfg + (cfg_scale - min_cfg) * (i3 * 1.0f / x->ne[3]), 0, 0, 0, i3);
                 }
+                cfg_scales_dev = sampler.new_tensor(cfg_scales, cfg_scales);
             }
 
-            return denoised;
-        };
+            auto denoise_on_backend = [&](ggml_tensor* input, float sigma, int step) -> ggml_tensor* {
+                if (step == 1) {
+                    pretty_progress(0, (int)steps, 0);
+                }
+                int64_t t0 = ggml_time_us();
+
+                std::vector<float> scaling = denoiser->get_scalings(sigma);
+                GGML_ASSERT(scaling.size() == 3);
+                float c_skip = scaling[0];
+                float c_out  = scaling[1];
+                float c_in   = scaling[2];
+
+                float t = denoiser->sigma_to_t(sigma);
+                std::vector<float> timesteps_vec(x->ne[3], t);  // [N, ]
+                auto timesteps = vector_to_ggml_tensor(work_ctx, timesteps_vec);
+                std::vector<float> guidance_vec(x->ne[3], guidance);
+                auto guidance_tensor = vector_to_ggml_tensor(work_ctx, guidance_vec);
+
+                auto scale_in = [&](ggml_context* ctx, const std::vector<ggml_tensor*>& s) -> ggml_tensor* {
+                    return ggml_mul(ctx, input, s[0]);
+                };
+                sampler.run("scale_in", {c_in}, scale_in, noised_dev);
+
+                const SDCondition& c = (start_merge_step == -1 || step <= start_merge_step) ? cond : merge_cond;
+                diffusion_model->compute(n_threads,
+                                         noised_dev,
+                                         timesteps,
+                                         c.c_crossattn,
+                                         c.c_concat,
+                                         c.c_vector,
+                                         guidance_tensor,
+                                         ref_latents,
+                                         -1,
+                                         {},
+                                         control_strength,
+                                         &out_cond_dev);
+                if (has_unconditioned) {
+                    diffusion_model->compute(n_threads,
+                                             noised_dev,
+                                             timesteps,
+                                             uncond.c_crossattn,
+                                             uncond.c_concat,
+                                             uncond.c_vector,
+                                             guidance_tensor,
+                                             ref_latents,
+                                             -1,
+                                             {},
+                                             control_strength,
+                                             &out_uncond_dev);
+                }
+                int step_count         = sigmas.size();
+                bool is_skiplayer_step = has_skiplayer && step > (int)(skip_layer_start * step_count) && step < (int)(skip_layer_end * step_count);
+                if (is_skiplayer_step) {
+                    LOG_DEBUG("Skipping layers at step %d\n", step);
+                    diffusion_model->compute(n_threads,
+                                             noised_dev,
+                                             timesteps,
+                                             cond.c_crossattn,
+                                             cond.c_concat,
+                                             cond.c_vector,
+                                             guidance_tensor,
+                                             ref_latents,
+                                             -1,
+                                             {},
+                                             control_strength,
+                                             &out_skip_dev,
+                                             NULL,
+                                             skip_layers);
+                }
 
-        sample_k_diffusion(method, denoise, work_ctx, x, sigmas, rng, eta);
+                // s: c_out, c_skip
+                auto combine = [&](ggml_context* ctx, const std::vector<ggml_tensor*>& s) -> ggml_tensor* {
+                    ggml_tensor* latent = out_cond_dev;
+                    if (has_unconditioned) {
+                        // out_uncond + cfg_scale * (out_cond - out_uncond)
+                        auto diff = ggml_sub(ctx, out_cond_dev, out_uncond_dev);
+                        if (cfg_scales_dev != NULL) {
+                            diff = ggml_mul(ctx, diff, cfg_scales_dev);
+                        } else {
+                            diff = ggml_scale(ctx, diff, cfg_scale);
+                        }
+                        latent = ggml_add(ctx, out_uncond_dev, diff);
+                    }
+                    if (is_skiplayer_step) {
+                        latent = ggml_add(ctx, latent, ggml_scale(ctx, ggml_sub(ctx, out_cond_dev, out_skip_dev), slg_scale));
+                    }
+                    // denoised = (v * c_out + input * c_skip) or (input + eps * c_out)
+                    auto result = ggml_add(ctx, ggml_mul(ctx, latent, s[0]), ggml_mul(ctx, input, s[1]));
+                    if (mask_dev != NULL) {
+                        result = ggml_add(ctx, init_dev, ggml_mul(ctx, ggml_sub(ctx, result, init_dev), mask_dev));
+                    }
+                    return result;
+                };
+                sampler.run(is_skiplayer_step ? "combine:slg" : "combine", {c_out, c_skip}, combine, denoised_dev);
+
+                int64_t t1 = ggml_time_us();
+                if (step > 0) {
+                    pretty_progress(step, (int)steps, (t1 - t0) / 1000000.f);
+                    sd_profile_step(step, (int)steps, t1 - t0);
+                }
+                return denoised_dev;
+            };
+
+            sample_k_diffusion_backend(method, denoise_on_backend, sampler, work_ctx, x, sigmas, sample_rng ? sample_rng : rng);
+        } else {
+            sample_k_diffusion(method, denoise, work_ctx, x, sigmas, sample_rng ? sample_rng : rng, eta);
+        }
 
         x = denoiser->inverse_noise_scaling(sigmas[sigmas.size() - 1], x);
 
@@ -1018,6 +1524,13 @@ public:
             control_net->free_compute_buffer();
         }
         diffusion_model->free_compute_buffer();
+        if (step_cache->evaluations > 0) {
+            LOG_INFO("step cache skipped %d of %d model evaluations (%.1f%%)",
+                     step_cache->skipped,
+                     step_cache->evaluations,
+                     step_cache->skipped * 100.f / step_cache->evaluations);
+        }
+        step_cache->reset();
         return x;
     }
 
@@ -1053,6 +1566,14 @@ public:
         return latent;
     }
 
+    int get_vae_tile_batch() {
+        // the video decoder treats the batch as frames
+        if (version == VERSION_SVD) {
+            return 1;
+        }
+        return vae_tile_batch;
+    }
+
     ggml_tensor* compute_first_stage(ggml_context* work_ctx, ggml_tensor* x, bool decode) {
         int64_t W = x->ne[0];
         int64_t H = x->ne[1];
@@ -1071,19 +1592,30 @@ public:
                                                  decode ? (H * 8) : (H / 8),  // height
                                                  decode ? 3 : C,
                                                  x->ne[3]);  // channels
-        int64_t t0          = ggml_time_ms();
+        // tiles are 32x32 (64x64 for taesd) in latent space, 8 times that in pixel space
+        int tile_size = use_tiny_autoencoder ? 64 : 32;
+        if (!decode) {
+            tile_size *= 8;
+        }
+        float tile_scale = decode ? 8.f : 1.f / 8;
+        bool tiled       = vae_tiling && x->ne[3] == 1 && x->ne[0] >= tile_size && x->ne[1] >= tile_size;
+        if (tiled) {
+            // overlapping tiles are blended into the result
+            ggml_set_f32(result, 0.f);
+        }
+        int64_t t0 = ggml_time_ms();
         if (!use_tiny_autoencoder) {
             if (decode) {
                 ggml_tensor_scale(x, 1.0f / scale_factor);
             } else {
                 ggml_tensor_scale_input(x);
             }
-            if (vae_tiling && decode) {  // TODO: support tiling vae encode
-                // split latent in 32x32 tiles and compute in several steps
+            if (tiled) {
+                // split in tiles and compute in several steps
                 auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
                     first_stage_model->compute(n_threads, in, decode, &out);
                 };
-                sd_tiling(x, result, 8, 32, 0.5f, on_tiling);
+                sd_tiling(x, result, tile_scale, tile_size, 0.5f, on_tiling, get_vae_tile_batch());
             } else {
                 first_stage_model->compute(n_threads, x, decode, &result);
             }
@@ -1092,12 +1624,12 @@ public:
                 ggml_tensor_scale_output(result);
             }
         } else {
-            if (vae_tiling && decode) {  // TODO: support tiling vae encode
-                // split latent in 64x64 tiles and compute in several steps
+            if (tiled) {
+                // split in tiles and compute in several steps
                 auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
                     tae_first_stage->compute(n_threads, in, decode, &out);
                 };
-                sd_tiling(x, result, 8, 64, 0.5f, on_tiling);
+                sd_tiling(x, result, tile_scale, tile_size, 0.5f, on_tiling, get_vae_tile_batch());
             } else {
                 tae_first_stage->compute(n_threads, x, decode, &result);
             }
@@ -1151,7 +1683,15 @@ sd_ctx_t* new_sd_ctx(const char* model_path_c_str,
                      bool diffusion_flash_attn,
                      bool chroma_use_dit_mask,
                      bool chroma_use_t5_mask,
-                     int chroma_t5_mask_pad) {
+                     int chroma_t5_mask_pad,
+                     bool batch_sampling,
+                     bool fused_cfg,
+                     int vae_tile_batch,
+                     int lora_cache_size,
+                     bool runtime_lora,
+                     bool sampler_on_backend,
+                     int cond_cache_mb,
+                     float step_cache_threshold) {
     sd_ctx_t* sd_ctx = (sd_ctx_t*)malloc(sizeof(sd_ctx_t));
     if (sd_ctx == NULL) {
         return NULL;
@@ -1202,6 +1742,15 @@ sd_ctx_t* new_sd_ctx(const char* model_path_c_str,
         free(sd_ctx);
         return NULL;
     }
+    sd_ctx->sd->batch_sampling       = batch_sampling;
+    sd_ctx->sd->fused_cfg            = fused_cfg;
+    sd_ctx->sd->vae_tile_batch       = vae_tile_batch;
+    sd_ctx->sd->lora_cache_size      = lora_cache_size;
+    sd_ctx->sd->runtime_lora         = runtime_lora;
+    sd_ctx->sd->sampler_on_backend   = sampler_on_backend;
+    sd_ctx->sd->cond_cache_max_bytes = cond_cache_mb > 0 ? (size_t)cond_cache_mb * 1024 * 1024 : 0;
+
+    sd_ctx->sd->diffusion_model->get_step_cache()->threshold = step_cache_threshold;
     return sd_ctx;
 }
 
@@ -1269,6 +1818,7 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
     sd_ctx->sd->apply_loras(lora_f2m);
     int64_t t1 = ggml_time_ms();
     LOG_INFO("apply_loras completed, taking %.2fs", (t1 - t0) * 1.0f / 1000);
+    sd_profile_stage("apply_loras", (int64_t)(t1 - t0) * 1000);
 
     // Photo Maker
     std::string prompt_text_only;
@@ -1282,6 +1832,7 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
             t1                             = ggml_time_ms();
             sd_ctx->sd->pmid_lora->applied = true;
             LOG_INFO("pmid_lora apply completed, taking %.2fs", (t1 - t0) * 1.0f / 1000);
+            sd_profile_stage("apply_pmid_lora", (int64_t)(t1 - t0) * 1000);
             if (sd_ctx->sd->free_params_immediately) {
                 sd_ctx->sd->pmid_lora->free_params_buffer();
             }
@@ -1330,9 +1881,9 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
             for (int i = 0; i < num_input_images; i++) {
                 sd_image_t* init_image = input_id_images[i];
                 if (normalize_input)
-                    sd_mul_images_to_tensor(init_image->data, init_img, i, mean, std);
+                    sd_mul_images_to_tensor(init_image->data, init_img, i, mean, std, sd_ctx->sd->n_threads);
                 else
-                    sd_mul_images_to_tensor(init_image->data, init_img, i, NULL, NULL);
+                    sd_mul_images_to_tensor(init_image->data, init_img, i, NULL, NULL, sd_ctx->sd->n_threads);
             }
             t0                            = ggml_time_ms();
             auto cond_tup                 = sd_ctx->sd->cond_stage_model->get_learned_condition_with_trigger(work_ctx,
@@ -1353,6 +1904,7 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
             id_cond.c_crossattn = sd_ctx->sd->id_encoder(work_ctx, init_img, id_cond.c_crossattn, id_embeds, class_tokens_mask);
             t1                  = ggml_time_ms();
             LOG_INFO("Photomaker ID Stacking, taking %" PRId64 " ms", t1 - t0);
+            sd_profile_stage("photomaker_id_stacking", (int64_t)(t1 - t0) * 1000);
             if (sd_ctx->sd->free_params_immediately) {
                 sd_ctx->sd->pmid_model->free_params_buffer();
             }
@@ -1377,13 +1929,7 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
 
     // Get learned condition
     t0               = ggml_time_ms();
-    SDCondition cond = sd_ctx->sd->cond_stage_model->get_learned_condition(work_ctx,
-                                                                           sd_ctx->sd->n_threads,
-                                                                           prompt,
-                                                                           clip_skip,
-                                                                           width,
-                                                                           height,
-                                                                           sd_ctx->sd->diffusion_model->get_adm_in_channels());
+    SDCondition cond = sd_ctx->sd->get_learned_condition(work_ctx, prompt, clip_skip, width, height);
 
     SDCondition uncond;
     if (cfg_scale != 1.0) {
@@ -1391,17 +1937,11 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
         if (sd_version_is_sdxl(sd_ctx->sd->version) && negative_prompt.size() == 0) {
             force_zero_embeddings = true;
         }
-        uncond = sd_ctx->sd->cond_stage_model->get_learned_condition(work_ctx,
-                                                                     sd_ctx->sd->n_threads,
-                                                                     negative_prompt,
-                                                                     clip_skip,
-                                                                     width,
-                                                                     height,
-                                                                     sd_ctx->sd->diffusion_model->get_adm_in_channels(),
-                                                                     force_zero_embeddings);
+        uncond = sd_ctx->sd->get_learned_condition(work_ctx, negative_prompt, clip_skip, width, height, force_zero_embeddings);
     }
     t1 = ggml_time_ms();
     LOG_INFO("get_learned_condition completed, taking %" PRId64 " ms", t1 - t0);
+    sd_profile_stage("get_learned_condition", (int64_t)(t1 - t0) * 1000);
 
     if (sd_ctx->sd->free_params_immediately) {
         sd_ctx->sd->cond_stage_model->free_params_buffer();
@@ -1411,7 +1951,7 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
     struct ggml_tensor* image_hint = NULL;
     if (control_cond != NULL) {
         image_hint = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, width, height, 3, 1);
-        sd_image_to_tensor(control_cond->data, image_hint);
+        sd_image_to_tensor(control_cond->data, image_hint, true, sd_ctx->sd->n_threads);
     }
 
     // Sample
@@ -1458,7 +1998,103 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
     } else {
         noise_mask = masked_image;
     }
-    for (int b = 0; b < batch_count; b++) {
+
+    int start_merge_step = -1;
+    if (sd_ctx->sd->stacked_id) {
+        start_merge_step = int(sd_ctx->sd->pmid_model->style_strength / 100.f * sample_steps);
+        // if (start_merge_step > 30)
+        //     start_merge_step = 30;
+        LOG_INFO("PHOTOMAKER: start_merge_step: %d", start_merge_step);
+    }
+
+    bool batch_sampling = sd_ctx->sd->batch_sampling && batch_count > 1;
+    if (batch_sampling && !sd_ctx->sd->can_batch_sampling(image_hint)) {
+        LOG_WARN("batch sampling is not supported for this model/configuration, sampling images one by one");
+        batch_sampling = false;
+    }
+
+    sd_image_t* result_images = (sd_image_t*)calloc(batch_count, sizeof(sd_image_t));
+    if (result_images == NULL) {
+        ggml_free(work_ctx);
+        return NULL;
+    }
+
+    // with an image callback the latents are decoded and handed over as soon as they are sampled,
+    // except the last one, which is decoded after the diffusion model is freed like without a callback
+    bool stream_images  = sd_image_cb_enabled();
+    int64_t decode_time = 0;
+    auto decode_latent  = [&](int b, struct ggml_tensor* latent) {
+        int64_t t1              = ggml_time_ms();
+        struct ggml_tensor* img = sd_ctx->sd->decode_first_stage(work_ctx, latent);
+        // print_ggml_tensor(img);
+        if (img != NULL) {
+            result_images[b].width   = width;
+            result_images[b].height  = height;
+            result_images[b].channel = 3;
+            result_images[b].data    = sd_tensor_to_image(img, sd_ctx->sd->n_threads);
+            if (stream_images) {
+                sd_image_ready(b, result_images[b]);
+                result_images[b].data = NULL;
+            }
+        }
+        int64_t t2 = ggml_time_ms();
+        decode_time += t2 - t1;
+        LOG_INFO("latent %d decoded, taking %.2fs", b + 1, (t2 - t1) * 1.0f / 1000);
+    };
+
+    if (batch_sampling) {
+        int64_t sampling_start = ggml_time_ms();
+        LOG_INFO("generating %i images in one batch - seeds %" PRId64 "..%" PRId64, batch_count, seed, seed + batch_count - 1);
+
+        std::vector<std::shared_ptr<RNG>> rngs;
+        for (int b = 0; b < batch_count; b++) {
+            rngs.push_back(sd_ctx->sd->new_rng());
+        }
+        std::shared_ptr<RNG> batch_rng = std::make_shared<BatchRNG>(rngs);
+        batch_rng->manual_seed(seed);
+
+        // [N, C, H, W], every sample starts from the same init latent
+        struct ggml_tensor* x_t = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, init_latent->ne[0], init_latent->ne[1], init_latent->ne[2], batch_count);
+        for (int b = 0; b < batch_count; b++) {
+            memcpy((char*)x_t->data + b * x_t->nb[3], init_latent->data, ggml_nbytes(init_latent));
+        }
+        struct ggml_tensor* noise = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, batch_count);
+        ggml_tensor_set_f32_randn(noise, batch_rng);
+
+        struct ggml_tensor* x_0 = sd_ctx->sd->sample(work_ctx,
+                                                     x_t,
+                                                     noise,
+                                                     cond,
+                                                     uncond,
+                                                     image_hint,
+                                                     control_strength,
+                                                     cfg_scale,
+                                                     cfg_scale,
+                                                     guidance,
+                                                     eta,
+                                                     sample_method,
+                                                     sigmas,
+                                                     start_merge_step,
+                                                     id_cond,
+                                                     ref_latents,
+                                                     skip_layers,
+                                                     slg_scale,
+                                                     skip_layer_start,
+                                                     skip_layer_end,
+                                                     noise_mask,
+                                                     batch_rng);
+
+        for (int b = 0; b < batch_count; b++) {
+            struct ggml_tensor* latent = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, x_0->ne[0], x_0->ne[1], x_0->ne[2], 1);
+            memcpy(latent->data, (char*)x_0->data + b * x_0->nb[3], ggml_nbytes(latent));
+            final_latents.push_back(latent);
+        }
+        int64_t sampling_end = ggml_time_ms();
+        LOG_INFO("sampling completed, taking %.2fs", (sampling_end - sampling_start) * 1.0f / 1000);
+        sd_profile_stage("sampling", (int64_t)(sampling_end - sampling_start) * 1000);
+    }
+
+    for (int b = 0; b < batch_count && !batch_sampling; b++) {
         int64_t sampling_start = ggml_time_ms();
         int64_t cur_seed       = seed + b;
         LOG_INFO("generating image: %i/%i - seed %" PRId64, b + 1, batch_count, cur_seed);
@@ -1468,14 +2104,6 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
         struct ggml_tensor* noise = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, 1);
         ggml_tensor_set_f32_randn(noise, sd_ctx->sd->rng);
 
-        int start_merge_step = -1;
-        if (sd_ctx->sd->stacked_id) {
-            start_merge_step = int(sd_ctx->sd->pmid_model->style_strength / 100.f * sample_steps);
-            // if (start_merge_step > 30)
-            //     start_merge_step = 30;
-            LOG_INFO("PHOTOMAKER: start_merge_step: %d", start_merge_step);
-        }
-
         struct ggml_tensor* x_0 = sd_ctx->sd->sample(work_ctx,
                                                      x_t,
                                                      noise,
@@ -1502,46 +2130,31 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
         // print_ggml_tensor(x_0);
         int64_t sampling_end = ggml_time_ms();
         LOG_INFO("sampling completed, taking %.2fs", (sampling_end - sampling_start) * 1.0f / 1000);
-        final_latents.push_back(x_0);
+        sd_profile_stage("sampling", (int64_t)(sampling_end - sampling_start) * 1000);
+        if (stream_images && b + 1 < batch_count) {
+            decode_latent(b, x_0);
+        } else {
+            final_latents.push_back(x_0);
+        }
     }
 
     if (sd_ctx->sd->free_params_immediately) {
         sd_ctx->sd->diffusion_model->free_params_buffer();
     }
     int64_t t3 = ggml_time_ms();
-    LOG_INFO("generating %" PRId64 " latent images completed, taking %.2fs", final_latents.size(), (t3 - t1) * 1.0f / 1000);
+    LOG_INFO("generating %d latent images completed, taking %.2fs", batch_count, (t3 - t1) * 1.0f / 1000);
 
     // Decode to image
     LOG_INFO("decoding %zu latents", final_latents.size());
-    std::vector<struct ggml_tensor*> decoded_images;  // collect decoded images
     for (size_t i = 0; i < final_latents.size(); i++) {
-        t1                      = ggml_time_ms();
-        struct ggml_tensor* img = sd_ctx->sd->decode_first_stage(work_ctx, final_latents[i] /* x_0 */);
-        // print_ggml_tensor(img);
-        if (img != NULL) {
-            decoded_images.push_back(img);
-        }
-        int64_t t2 = ggml_time_ms();
-        LOG_INFO("latent %" PRId64 " decoded, taking %.2fs", i + 1, (t2 - t1) * 1.0f / 1000);
+        decode_latent((int)i, final_latents[i] /* x_0 */);
     }
 
-    int64_t t4 = ggml_time_ms();
-    LOG_INFO("decode_first_stage completed, taking %.2fs", (t4 - t3) * 1.0f / 1000);
+    LOG_INFO("decode_first_stage completed, taking %.2fs", decode_time * 1.0f / 1000);
+    sd_profile_stage("decode_first_stage", decode_time * 1000);
     if (sd_ctx->sd->free_params_immediately && !sd_ctx->sd->use_tiny_autoencoder) {
         sd_ctx->sd->first_stage_model->free_params_buffer();
     }
-    sd_image_t* result_images = (sd_image_t*)calloc(batch_count, sizeof(sd_image_t));
-    if (result_images == NULL) {
-        ggml_free(work_ctx);
-        return NULL;
-    }
-
-    for (size_t i = 0; i < decoded_images.size(); i++) {
-        result_images[i].width   = width;
-        result_images[i].height  = height;
-        result_images[i].channel = 3;
-        result_images[i].data    = sd_tensor_to_image(decoded_images[i]);
-    }
     ggml_free(work_ctx);
 
     return result_images;
@@ -1653,6 +2266,7 @@ sd_image_t* txt2img(sd_ctx_t* sd_ctx,
     size_t t1 = ggml_time_ms();
 
     LOG_INFO("txt2img completed in %.2fs", (t1 - t0) * 1.0f / 1000);
+    sd_profile_stage("txt2img", (int64_t)(t1 - t0) * 1000);
 
     return result_images;
 }
@@ -1723,9 +2337,9 @@ sd_image_t* img2img(sd_ctx_t* sd_ctx,
     ggml_tensor* init_img = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, width, height, 3, 1);
     ggml_tensor* mask_img = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, width, height, 1, 1);
 
-    sd_mask_to_tensor(mask.data, mask_img);
+    sd_mask_to_tensor(mask.data, mask_img, true, sd_ctx->sd->n_threads);
 
-    sd_image_to_tensor(init_image.data, init_img);
+    sd_image_to_tensor(init_image.data, init_img, true, sd_ctx->sd->n_threads);
 
     ggml_tensor* masked_image;
 
@@ -1735,7 +2349,7 @@ sd_image_t* img2img(sd_ctx_t* sd_ctx,
             mask_channels = 8 * 8;  // flatten the whole mask
         }
         ggml_tensor* masked_img = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, width, height, 3, 1);
-        sd_apply_mask(init_img, mask_img, masked_img);
+        sd_apply_mask(init_img, mask_img, masked_img, sd_ctx->sd->n_threads);
         ggml_tensor* masked_image_0 = NULL;
         if (!sd_ctx->sd->use_tiny_autoencoder) {
             ggml_tensor* moments = sd_ctx->sd->encode_first_stage(work_ctx, masked_img);
@@ -1796,6 +2410,7 @@ sd_image_t* img2img(sd_ctx_t* sd_ctx,
     print_ggml_tensor(init_latent, true);
     size_t t1 = ggml_time_ms();
     LOG_INFO("encode_first_stage completed, taking %.2fs", (t1 - t0) * 1.0f / 1000);
+    sd_profile_stage("encode_first_stage", (int64_t)(t1 - t0) * 1000);
 
     std::vector<float> sigmas = sd_ctx->sd->denoiser->get_sigmas(sample_steps);
     size_t t_enc              = static_cast<size_t>(sample_steps * strength);
@@ -1835,6 +2450,7 @@ sd_image_t* img2img(sd_ctx_t* sd_ctx,
     size_t t2 = ggml_time_ms();
 
     LOG_INFO("img2img completed in %.2fs", (t2 - t0) * 1.0f / 1000);
+    sd_profile_stage("img2img", (int64_t)(t2 - t0) * 1000);
 
     return result_images;
 }
@@ -1903,6 +2519,7 @@ SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
 
     int64_t t1 = ggml_time_ms();
     LOG_INFO("get_learned_condition completed, taking %" PRId64 " ms", t1 - t0);
+    sd_profile_stage("get_learned_condition", (int64_t)(t1 - t0) * 1000);
     if (sd_ctx->sd->free_params_immediately) {
         sd_ctx->sd->clip_vision->free_params_buffer();
     }
@@ -1936,6 +2553,7 @@ SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
 
     int64_t t2 = ggml_time_ms();
     LOG_INFO("sampling completed, taking %.2fs", (t2 - t1) * 1.0f / 1000);
+    sd_profile_stage("sampling", (int64_t)(t2 - t1) * 1000);
     if (sd_ctx->sd->free_params_immediately) {
         sd_ctx->sd->diffusion_model->free_params_buffer();
     }
@@ -1961,13 +2579,14 @@ SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
         result_images[i].width   = width;
         result_images[i].height  = height;
         result_images[i].channel = 3;
-        result_images[i].data    = sd_tensor_to_image(img_i);
+        result_images[i].data    = sd_tensor_to_image(img_i, sd_ctx->sd->n_threads);
     }
     ggml_free(work_ctx);
 
     int64_t t3 = ggml_time_ms();
 
     LOG_INFO("img2vid completed in %.2fs", (t3 - t0) * 1.0f / 1000);
+    sd_profile_stage("img2vid", (int64_t)(t3 - t0) * 1000);
 
     return result_images;
 }
@@ -2049,7 +2668,7 @@ sd_image_t* edit(sd_ctx_t* sd_ctx,
     std::vector<struct ggml_tensor*> ref_latents;
     for (int i = 0; i < ref_images_count; i++) {
         ggml_tensor* img = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, ref_images[i].width, ref_images[i].height, 3, 1);
-        sd_image_to_tensor(ref_images[i].data, img);
+        sd_image_to_tensor(ref_images[i].data, img, true, sd_ctx->sd->n_threads);
 
         ggml_tensor* latent = NULL;
         if (!sd_ctx->sd->use_tiny_autoencoder) {
@@ -2063,6 +2682,7 @@ sd_image_t* edit(sd_ctx_t* sd_ctx,
 
     size_t t1 = ggml_time_ms();
     LOG_INFO("encode_first_stage completed, taking %.2fs", (t1 - t0) * 1.0f / 1000);
+    sd_profile_stage("encode_first_stage", (int64_t)(t1 - t0) * 1000);
 
     std::vector<float> sigmas = sd_ctx->sd->denoiser->get_sigmas(sample_steps);
 
@@ -2096,6 +2716,7 @@ sd_image_t* edit(sd_ctx_t* sd_ctx,
     size_t t2 = ggml_time_ms();
 
     LOG_INFO("edit completed in %.2fs", (t2 - t0) * 1.0f / 1000);
+    sd_profile_stage("edit", (int64_t)(t2 - t0) * 1000);
 
     return result_images;
 }
\ No newline at end of file
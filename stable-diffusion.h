@@ -115,8 +115,38 @@ enum sd_log_level_t {
 typedef void (*sd_log_cb_t)(enum sd_log_level_t level, const char* text, void* data);
 typedef void (*sd_progress_cb_t)(int step, int steps, float time, void* data);
 
+enum sd_profile_event_type_t {
+    SD_PROFILE_STAGE,    // a stage finished, e.g. "apply_loras", "sampling", "decode_first_stage"
+    SD_PROFILE_STEP,     // a sampling step finished
+    SD_PROFILE_COMPUTE,  // a model graph was computed, name is the model, e.g. "unet", "vae", "clip"
+};
+
+typedef struct {
+    enum sd_profile_event_type_t type;
+    const char* name;
+    // SD_PROFILE_STEP: 1-based step and number of steps of the current sampling
+    int step;
+    int steps;
+    int64_t time_us;
+    // SD_PROFILE_COMPUTE: time spent building and allocating the graph (0 when a cached graph
+    // was reused) and computing it, buffers of the model
+    int64_t build_time_us;
+    int64_t compute_time_us;
+    size_t params_buffer_size;
+    size_t compute_buffer_size;
+    bool on_device;
+    // peak resident memory of the process and peak size of the backend buffers of all
+    // models outside of RAM, both so far
+    size_t peak_host_memory;
+    size_t peak_device_memory;
+} sd_profile_event_t;
+
+typedef void (*sd_profile_cb_t)(const sd_profile_event_t* event, void* data);
+
 SD_API void sd_set_log_callback(sd_log_cb_t sd_log_cb, void* data);
 SD_API void sd_set_progress_callback(sd_progress_cb_t cb, void* data);
+// the callback is called from the generating thread, the event is only valid during the call
+SD_API void sd_set_profile_callback(sd_profile_cb_t cb, void* data);
 SD_API int32_t get_num_physical_cores();
 SD_API const char* sd_get_system_info();
 
@@ -129,6 +159,15 @@ typedef struct {
 
 typedef struct sd_ctx_t sd_ctx_t;
 
+// index of the image in the batch, its seed is seed + index
+typedef void (*sd_image_cb_t)(int index, sd_image_t image, void* data);
+
+// txt2img, img2img and edit pass every image to the callback as soon as it is decoded and
+// decode each latent but the last right after sampling it, so the caller can process an image
+// while the next one is sampled. The callback takes ownership of image.data, the matching entry of the
+// returned array is left with data NULL. The callback is called from the generating thread.
+SD_API void sd_set_image_callback(sd_image_cb_t cb, void* data);
+
 SD_API sd_ctx_t* new_sd_ctx(const char* model_path,
                             const char* clip_l_path,
                             const char* clip_g_path,
@@ -153,7 +192,15 @@ SD_API sd_ctx_t* new_sd_ctx(const char* model_path,
                             bool diffusion_flash_attn,
                             bool chroma_use_dit_mask,
                             bool chroma_use_t5_mask,
-                            int chroma_t5_mask_pad);
+                            int chroma_t5_mask_pad,
+                            bool batch_sampling,
+                            bool fused_cfg,
+                            int vae_tile_batch,
+                            int lora_cache_size,
+                            bool runtime_lora,
+                            bool sampler_on_backend,
+                            int cond_cache_mb,
+                            float step_cache_threshold);
 
 SD_API void free_sd_ctx(sd_ctx_t* sd_ctx);
 
@@ -252,7 +299,8 @@ SD_API sd_image_t* edit(sd_ctx_t* sd_ctx,
 typedef struct upscaler_ctx_t upscaler_ctx_t;
 
 SD_API upscaler_ctx_t* new_upscaler_ctx(const char* esrgan_path,
-                                        int n_threads);
+                                        int n_threads,
+                                        int tile_batch);
 SD_API void free_upscaler_ctx(upscaler_ctx_t* upscaler_ctx);
 
 SD_API sd_image_t upscale(upscaler_ctx_t* upscaler_ctx, sd_image_t input_image, uint32_t upscale_factor);
@@ -62,7 +62,8 @@ public:
         NO_ENTRY_FOUND,
         BUILD_DOUBLE_ARRAY_FAILED,
         PIECE_ALREADY_DEFINED,
-        INVLIAD_JSON
+        INVLIAD_JSON,
+        INVALID_BINARY
     };
 
 protected:
@@ -70,6 +71,9 @@ protected:
 
     // all <piece, score> pairs
     std::vector<std::pair<std::string, float>> piece_score_pairs;
+    // score bits of every piece, either owned_scores_ or the binary model
+    const uint32_t* scores_ = nullptr;
+    std::vector<uint32_t> owned_scores_;
 
     float min_score_ = 0.0;
     float max_score_ = 0.0;
@@ -173,9 +177,43 @@ protected:
             status_ = NO_ENTRY_FOUND;
     }
 
+    // Uses the binary model written by tools/t5_tokenizer_gen.cpp in place, scores and
+    // trie units point into data, which must outlive the tokenizer.
+    void InitializeFromBinary(const uint32_t* data, size_t n_words) {
+        const uint32_t magic      = 0x4B543554;  // "T5TK"
+        const uint32_t version    = 2;
+        const size_t header_words = 17;
+        if (data == nullptr || n_words < header_words || data[0] != magic || data[1] != version ||
+            n_words != header_words + data[7] + data[8] || data[7] == 0) {
+            status_ = INVALID_BINARY;
+            return;
+        }
+
+        unk_id_ = (int32_t)data[2];
+        memcpy(&min_score_, &data[4], sizeof(float));
+        memcpy(&max_score_, &data[5], sizeof(float));
+        trie_results_size_ = (int32_t)data[6];
+
+        // one byte per word
+        char replacement_buf[8];
+        for (int i = 0; i < 8; i++) {
+            replacement_buf[i] = (char)data[9 + i];
+        }
+        replacement_buf[7] = 0;
+        replacement        = replacement_buf;
+        add_prefix_space   = data[3] != 0;
+        pre_tokenizer      = MetaspacePreTokenizer(replacement, add_prefix_space);
+
+        scores_ = data + header_words;
+        trie_   = std::unique_ptr<Darts::DoubleArray>(new Darts::DoubleArray());
+        trie_->set_array(scores_ + data[7], data[8]);
+    }
+
     // Non-virtual (inlined) implementation for faster execution.
     inline float GetScoreInlined(int id) const {
-        return piece_score_pairs[id].second;
+        float score;
+        memcpy(&score, &scores_[id], sizeof(score));
+        return score;
     }
 
     inline bool IsUnusedInlined(int id) const {
@@ -334,13 +372,8 @@ protected:
         return results;
     }
 
-public:
-    explicit T5UniGramTokenizer(const std::string& json_str = "") {
-        if (json_str.size() != 0) {
-            InitializePieces(json_str);
-        } else {
-            InitializePieces(ModelLoader::load_t5_tokenizer_json());
-        }
+    void InitializeFromJson(const std::string& json_str) {
+        InitializePieces(json_str);
 
         min_score_ = FLT_MAX;
         max_score_ = FLT_MIN;
@@ -353,10 +386,32 @@ public:
             max_score_ = std::max(max_score_, sp.second);
 
             pieces.emplace_back(sp.first, i);
+
+            uint32_t score_bits;
+            memcpy(&score_bits, &sp.second, sizeof(score_bits));
+            owned_scores_.push_back(score_bits);
         }
+        scores_ = owned_scores_.data();
 
         BuildTrie(&pieces);
     }
+
+public:
+    // Without json_str the binary model generated at build time is used as is, nothing is parsed.
+    // Builds without the generated model (cross compiles without a host generator) parse the
+    // embedded json instead.
+    explicit T5UniGramTokenizer(const std::string& json_str = "") {
+        if (json_str.size() > 0) {
+            InitializeFromJson(json_str);
+            return;
+        }
+        std::pair<const uint32_t*, size_t> model = ModelLoader::load_t5_tokenizer_bin();
+        if (model.first != NULL) {
+            InitializeFromBinary(model.first, model.second);
+        } else {
+            InitializeFromJson(ModelLoader::load_t5_tokenizer_json());
+        }
+    }
     ~T5UniGramTokenizer(){};
 
     std::string Normalize(const std::string& input) const {
@@ -254,7 +254,7 @@ struct TinyAutoEncoder : public GGMLRunner {
             return build_graph(z, decode_graph);
         };
 
-        GGMLRunner::compute(get_graph, n_threads, false, output, output_ctx);
+        GGMLRunner::compute_cached(get_graph, {z}, decode_graph ? "decode" : "encode", n_threads, output, output_ctx);
     }
 };
 
@@ -283,6 +283,15 @@ extern ZIP_EXPORT unsigned long long zip_entry_comp_size(struct zip_t *zip);
  */
 extern ZIP_EXPORT unsigned int zip_entry_crc32(struct zip_t *zip);
 
+/**
+ * Returns the offset of the local header of the current zip entry.
+ *
+ * @param zip zip archive handler.
+ *
+ * @return the offset in bytes from the start of the archive.
+ */
+extern ZIP_EXPORT unsigned long long zip_entry_header_offset(struct zip_t *zip);
+
 /**
  * Compresses an input buffer for the current zip entry.
  *
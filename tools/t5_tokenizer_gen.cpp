@@ -0,0 +1,133 @@
+// Converts the T5 tokenizer json embedded in vocab.hpp into the binary model loaded by
+// T5UniGramTokenizer (t5.hpp), and writes it as a C array to the header given on the command line.
+//
+// Layout, every field 4 bytes wide:
+//   uint32 magic "T5TK", uint32 version, int32 unk_id, uint32 add_prefix_space,
+//   float min_score, float max_score, int32 trie_results_size, uint32 n_pieces, uint32 n_units,
+//   uint32 replacement[8], float scores[n_pieces], uint32 trie units[n_units]
+// The replacement string is stored one byte per word, so the array only holds word values and
+// reads the same on targets of either byte order.
+
+#include <float.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "darts.h"
+#include "json.hpp"
+#include "vocab.hpp"
+
+static const uint32_t T5_TOKENIZER_MAGIC   = 0x4B543554;  // "T5TK"
+static const uint32_t T5_TOKENIZER_VERSION = 2;
+
+static void push_u32(std::vector<uint32_t>& out, uint32_t v) {
+    out.push_back(v);
+}
+
+static void push_f32(std::vector<uint32_t>& out, float v) {
+    uint32_t u;
+    memcpy(&u, &v, sizeof(u));
+    out.push_back(u);
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <output header>\n", argv[0]);
+        return 1;
+    }
+
+    std::string json_str(reinterpret_cast<const char*>(t5_tokenizer_json_str), sizeof(t5_tokenizer_json_str));
+    nlohmann::json data;
+    try {
+        data = nlohmann::json::parse(json_str);
+    } catch (const nlohmann::json::parse_error& e) {
+        fprintf(stderr, "invalid tokenizer json: %s\n", e.what());
+        return 1;
+    }
+    nlohmann::json model = data["model"];
+    int unk_id           = model.contains("unk_id") ? model["unk_id"].get<int>() : 2;
+    std::string replacement = data["pre_tokenizer"]["replacement"];
+    bool add_prefix_space   = data["pre_tokenizer"]["add_prefix_space"];
+    if (replacement.size() >= 8) {
+        fprintf(stderr, "replacement '%s' is too long\n", replacement.c_str());
+        return 1;
+    }
+
+    std::vector<float> scores;
+    std::vector<std::pair<std::string, int>> pieces;
+    float min_score = FLT_MAX;
+    float max_score = FLT_MIN;
+    for (const auto& item : model["vocab"]) {
+        if (item.size() != 2 || !item[0].is_string() || !item[1].is_number_float()) {
+            fprintf(stderr, "invalid vocab entry\n");
+            return 1;
+        }
+        float score = item[1];
+        min_score   = std::min(min_score, score);
+        max_score   = std::max(max_score, score);
+        pieces.emplace_back(item[0].get<std::string>(), (int)scores.size());
+        scores.push_back(score);
+    }
+    if (pieces.empty()) {
+        fprintf(stderr, "no pieces in tokenizer json\n");
+        return 1;
+    }
+
+    // same trie as T5UniGramTokenizer::BuildTrie
+    std::sort(pieces.begin(), pieces.end());
+    std::vector<const char*> key(pieces.size());
+    std::vector<int> value(pieces.size());
+    for (size_t i = 0; i < pieces.size(); ++i) {
+        key[i]   = pieces[i].first.data();
+        value[i] = pieces[i].second;
+    }
+    Darts::DoubleArray trie;
+    if (trie.build(key.size(), const_cast<char**>(&key[0]), nullptr, &value[0]) != 0) {
+        fprintf(stderr, "failed to build the double array\n");
+        return 1;
+    }
+    std::vector<Darts::DoubleArray::result_pair_type> results(1024);
+    int trie_results_size = 0;
+    for (const auto& p : pieces) {
+        int num_nodes     = (int)trie.commonPrefixSearch(p.first.data(), results.data(), results.size(), p.first.size());
+        trie_results_size = std::max(trie_results_size, num_nodes);
+    }
+
+    std::vector<uint32_t> words;
+    push_u32(words, T5_TOKENIZER_MAGIC);
+    push_u32(words, T5_TOKENIZER_VERSION);
+    push_u32(words, (uint32_t)unk_id);
+    push_u32(words, add_prefix_space ? 1 : 0);
+    push_f32(words, min_score);
+    push_f32(words, max_score);
+    push_u32(words, (uint32_t)trie_results_size);
+    push_u32(words, (uint32_t)scores.size());
+    push_u32(words, (uint32_t)trie.size());
+    for (size_t i = 0; i < 8; i++) {
+        push_u32(words, i < replacement.size() ? (uint8_t)replacement[i] : 0);
+    }
+    for (float score : scores) {
+        push_f32(words, score);
+    }
+    const uint32_t* units = reinterpret_cast<const uint32_t*>(trie.array());
+    words.insert(words.end(), units, units + trie.size());
+
+    FILE* fp = fopen(argv[1], "w");
+    if (fp == NULL) {
+        fprintf(stderr, "failed to open '%s'\n", argv[1]);
+        return 1;
+    }
+    // emitted as words so the array is aligned for the scores and trie units
+    fprintf(fp, "// generated by tools/t5_tokenizer_gen.cpp, do not edit\n");
+    fprintf(fp, "static const uint32_t t5_tokenizer_bin[%zu] = {\n", words.size());
+    for (size_t i = 0; i < words.size(); i++) {
+        fprintf(fp, "0x%08x,%s", words[i], (i % 8 == 7 || i + 1 == words.size()) ? "\n" : " ");
+    }
+    fprintf(fp, "};\n");
+    fclose(fp);
+    return 0;
+}
@@ -384,7 +384,8 @@ public:
                                 struct ggml_tensor* y                     = NULL,
                                 int num_video_frames                      = -1,
                                 std::vector<struct ggml_tensor*> controls = {},
-                                float control_strength                    = 0.f) {
+                                float control_strength                    = 0.f,
+                                StepCache* step_cache                     = NULL) {
         // x: [N, in_channels, h, w] or [N, in_channels/2, h, w]
         // timesteps: [N,]
         // context: [N, max_position, hidden_size] or [1, max_position, hidden_size]. for example, [N, 77, 768]
@@ -447,6 +448,10 @@ public:
         size_t len_mults    = channel_mult.size();
         int input_block_idx = 0;
         int ds              = 1;
+        // DeepCache: when skipping, only input block 1 and the last two output blocks run,
+        // everything in between is the saved input of output block n_out - 2
+        bool deep_cached = step_cache != NULL && step_cache->skipping();
+        int n_out        = (int)len_mults * (num_res_blocks + 1);
         for (int i = 0; i < len_mults; i++) {
             int mult = channel_mult[i];
             for (int j = 0; j < num_res_blocks; j++) {
@@ -458,6 +463,18 @@ public:
                     h                = attention_layer_forward(name, ctx, h, context, num_video_frames);  // [N, mult*model_channels, h, w]
                 }
                 hs.push_back(h);
+                if (step_cache != NULL && input_block_idx == 1) {
+                    auto change = step_cache->first_block(ctx, h);
+                    if (change != NULL) {
+                        return change;
+                    }
+                    if (deep_cached) {
+                        break;
+                    }
+                }
+            }
+            if (deep_cached) {
+                break;
             }
             if (i != len_mults - 1) {
                 ds *= 2;
@@ -473,11 +490,13 @@ public:
         // [N, 4*model_channels, h/8, w/8]
 
         // middle_block
-        h = resblock_forward("middle_block.0", ctx, h, emb, num_video_frames);             // [N, 4*model_channels, h/8, w/8]
-        h = attention_layer_forward("middle_block.1", ctx, h, context, num_video_frames);  // [N, 4*model_channels, h/8, w/8]
-        h = resblock_forward("middle_block.2", ctx, h, emb, num_video_frames);             // [N, 4*model_channels, h/8, w/8]
+        if (!deep_cached) {
+            h = resblock_forward("middle_block.0", ctx, h, emb, num_video_frames);             // [N, 4*model_channels, h/8, w/8]
+            h = attention_layer_forward("middle_block.1", ctx, h, context, num_video_frames);  // [N, 4*model_channels, h/8, w/8]
+            h = resblock_forward("middle_block.2", ctx, h, emb, num_video_frames);             // [N, 4*model_channels, h/8, w/8]
+        }
 
-        if (controls.size() > 0) {
+        if (controls.size() > 0 && !deep_cached) {
             auto cs = ggml_scale_inplace(ctx, controls[controls.size() - 1], control_strength);
             h       = ggml_add(ctx, h, cs);  // middle control
         }
@@ -487,6 +506,20 @@ public:
         int output_block_idx = 0;
         for (int i = (int)len_mults - 1; i >= 0; i--) {
             for (int j = 0; j < num_res_blocks + 1; j++) {
+                if (deep_cached && output_block_idx < n_out - 2) {
+                    // ds is 1 already, the skipped blocks only move the control offset
+                    control_offset--;
+                    output_block_idx += 1;
+                    continue;
+                }
+                if (step_cache != NULL && output_block_idx == n_out - 2) {
+                    if (deep_cached) {
+                        h = step_cache->saved();
+                    } else {
+                        step_cache->save(ctx, h);
+                    }
+                }
+
                 auto h_skip = hs.back();
                 hs.pop_back();
 
@@ -535,6 +568,8 @@ public:
 
 struct UNetModelRunner : public GGMLRunner {
     UnetModelBlock unet;
+    StepCache step_cache;
+    RuntimeLoraMap runtime_loras;
 
     UNetModelRunner(ggml_backend_t backend,
                     std::map<std::string, enum ggml_type>& tensor_types,
@@ -543,6 +578,8 @@ struct UNetModelRunner : public GGMLRunner {
                     bool flash_attn   = false)
         : GGMLRunner(backend), unet(version, tensor_types, flash_attn) {
         unet.init(params_ctx, tensor_types, prefix);
+        unet.set_runtime_lora_map(&runtime_loras);
+        step_cache.backend = backend;
     }
 
     std::string get_desc() {
@@ -561,7 +598,7 @@ struct UNetModelRunner : public GGMLRunner {
                                     int num_video_frames                      = -1,
                                     std::vector<struct ggml_tensor*> controls = {},
                                     float control_strength                    = 0.f) {
-        struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, UNET_GRAPH_SIZE, false);
+        struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, get_runtime_lora_graph_size(runtime_loras, UNET_GRAPH_SIZE), false);
 
         if (num_video_frames == -1) {
             num_video_frames = x->ne[3];
@@ -585,8 +622,10 @@ struct UNetModelRunner : public GGMLRunner {
                                                y,
                                                num_video_frames,
                                                controls,
-                                               control_strength);
+                                               control_strength,
+                                               &step_cache);
 
+        step_cache.expand(gf);
         ggml_build_forward_expand(gf, out);
 
         return gf;
@@ -612,7 +651,19 @@ struct UNetModelRunner : public GGMLRunner {
             return build_graph(x, timesteps, context, c_concat, y, num_video_frames, controls, control_strength);
         };
 
-        GGMLRunner::compute(get_graph, n_threads, false, output, output_ctx);
+        std::string key                         = "unet:" + std::to_string(num_video_frames);
+        std::vector<struct ggml_tensor*> inputs = {x, timesteps, context, c_concat, y};
+        if (controls.size() > 0) {
+            // controls live in the control net's buffer, they are inputs so the graph doesn't point into it
+            char strength[32];
+            snprintf(strength, sizeof(strength), ":control:%a", control_strength);
+            key += strength;
+            inputs.insert(inputs.end(), controls.begin(), controls.end());
+        }
+        auto run = [&](struct ggml_tensor** out, struct ggml_context* out_ctx) {
+            GGMLRunner::compute_cached(get_graph, inputs, key + step_cache.graph_key(), n_threads, out, out_ctx);
+        };
+        step_cache.evaluate(context, true, run, output, output_ctx);
     }
 
     void test() {
@@ -1,10 +1,13 @@
 #include "util.h"
 #include <stdarg.h>
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <codecvt>
+#include <condition_variable>
 #include <fstream>
 #include <locale>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <thread>
@@ -19,7 +22,11 @@
 
 #if !defined(_WIN32)
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <unistd.h>
+#else
+#include <windows.h>
+#include <psapi.h>
 #endif
 
 #include "ggml-cpu.h"
@@ -149,8 +156,52 @@ std::vector<std::string> get_files_from_dir(const std::string& dir) {
     return files;
 }
 
+std::unique_ptr<MmapFile> MmapFile::open(const std::string& filename) {
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return nullptr;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        return nullptr;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) {
+        CloseHandle(file);
+        return nullptr;
+    }
+    void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (data == NULL) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return nullptr;
+    }
+    std::unique_ptr<MmapFile> mmap_file(new MmapFile());
+    mmap_file->data_    = (uint8_t*)data;
+    mmap_file->size_    = (size_t)file_size.QuadPart;
+    mmap_file->file_    = file;
+    mmap_file->mapping_ = mapping;
+    return mmap_file;
+}
+
+MmapFile::~MmapFile() {
+    if (data_ != nullptr) {
+        UnmapViewOfFile(data_);
+    }
+    if (mapping_ != nullptr) {
+        CloseHandle((HANDLE)mapping_);
+    }
+    if (file_ != nullptr) {
+        CloseHandle((HANDLE)file_);
+    }
+}
+
 #else  // Unix
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 bool file_exists(const std::string& filename) {
@@ -204,6 +255,37 @@ std::vector<std::string> get_files_from_dir(const std::string& dir) {
     return files;
 }
 
+std::unique_ptr<MmapFile> MmapFile::open(const std::string& filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping keeps its own reference to the file
+    close(fd);
+    if (data == MAP_FAILED) {
+        return nullptr;
+    }
+#ifdef POSIX_MADV_SEQUENTIAL
+    posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+#endif
+    std::unique_ptr<MmapFile> mmap_file(new MmapFile());
+    mmap_file->data_ = (uint8_t*)data;
+    mmap_file->size_ = (size_t)st.st_size;
+    return mmap_file;
+}
+
+MmapFile::~MmapFile() {
+    if (data_ != nullptr) {
+        munmap(data_, size_);
+    }
+}
+
 #endif
 
 // get_num_physical_cores is copy from
@@ -244,6 +326,121 @@ int32_t get_num_physical_cores() {
     return n_threads > 0 ? (n_threads <= 4 ? n_threads : n_threads / 2) : 4;
 }
 
+// workers of sd_parallel_for, started on first use. A job is split in tasks the workers and
+// the calling thread take in turn, only one job runs at a time.
+class ParallelForPool {
+public:
+    ~ParallelForPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_cv.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // returns false without running anything when another job is running
+    bool run(int64_t n_tasks, const std::function<void(int64_t)>& task) {
+        std::unique_lock<std::mutex> running(run_mutex, std::try_to_lock);
+        if (!running.owns_lock()) {
+            return false;
+        }
+        auto job = std::make_shared<Job>(task, n_tasks);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            while ((int64_t)workers.size() < n_tasks - 1) {
+                workers.emplace_back([this]() { work(); });
+            }
+            current = job;
+        }
+        work_cv.notify_all();
+
+        int64_t done = job->run();
+        std::unique_lock<std::mutex> lock(mutex);
+        job->done += done;
+        done_cv.wait(lock, [&]() { return job->done == n_tasks; });
+        current.reset();
+        return true;
+    }
+
+private:
+    struct Job {
+        const std::function<void(int64_t)>& task;
+        int64_t n_tasks;
+        std::atomic<int64_t> next;
+        int64_t done = 0;
+
+        Job(const std::function<void(int64_t)>& task, int64_t n_tasks)
+            : task(task), n_tasks(n_tasks), next(0) {}
+
+        // runs tasks until there are none left, returns how many
+        int64_t run() {
+            int64_t count = 0;
+            for (int64_t i = next++; i < n_tasks; i = next++) {
+                task(i);
+                count++;
+            }
+            return count;
+        }
+    };
+
+    void work() {
+        std::shared_ptr<Job> last;
+        while (true) {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work_cv.wait(lock, [&]() { return stopping || (current != nullptr && current != last); });
+                if (stopping) {
+                    return;
+                }
+                job = current;
+            }
+            // a worker waking up late finds no tasks left and never calls the finished task
+            int64_t done = job->run();
+            last         = job;
+            if (done > 0) {
+                std::lock_guard<std::mutex> lock(mutex);
+                job->done += done;
+                done_cv.notify_all();
+            }
+        }
+    }
+
+    std::mutex run_mutex;
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    std::vector<std::thread> workers;
+    std::shared_ptr<Job> current;
+    bool stopping = false;
+};
+
+void sd_parallel_for(int n_threads,
+                     int64_t n,
+                     int64_t min_per_thread,
+                     const std::function<void(int64_t, int64_t)>& fn) {
+    static ParallelForPool pool;
+    if (n_threads <= 0) {
+        n_threads = get_num_physical_cores();
+    }
+    int64_t n_tasks = std::min((int64_t)n_threads, n / std::max((int64_t)1, min_per_thread));
+    if (n_tasks <= 1) {
+        fn(0, n);
+        return;
+    }
+    int64_t chunk = (n + n_tasks - 1) / n_tasks;
+    n_tasks       = (n + chunk - 1) / chunk;
+    auto task     = [&](int64_t i) {
+        fn(i * chunk, std::min(n, (i + 1) * chunk));
+    };
+    if (!pool.run(n_tasks, task)) {
+        fn(0, n);
+    }
+}
+
 static sd_progress_cb_t sd_progress_cb = NULL;
 void* sd_progress_cb_data              = NULL;
 
@@ -420,6 +617,98 @@ void sd_set_progress_callback(sd_progress_cb_t cb, void* data) {
     sd_progress_cb      = cb;
     sd_progress_cb_data = data;
 }
+
+static sd_image_cb_t sd_image_cb = NULL;
+static void* sd_image_cb_data     = NULL;
+
+void sd_set_image_callback(sd_image_cb_t cb, void* data) {
+    sd_image_cb      = cb;
+    sd_image_cb_data = data;
+}
+
+bool sd_image_cb_enabled() {
+    return sd_image_cb != NULL;
+}
+
+void sd_image_ready(int index, sd_image_t image) {
+    if (sd_image_cb != NULL) {
+        sd_image_cb(index, image, sd_image_cb_data);
+    }
+}
+
+static sd_profile_cb_t sd_profile_cb = NULL;
+static void* sd_profile_cb_data      = NULL;
+static std::atomic<int64_t> device_memory(0);
+static std::atomic<int64_t> device_memory_peak(0);
+
+void sd_set_profile_callback(sd_profile_cb_t cb, void* data) {
+    sd_profile_cb      = cb;
+    sd_profile_cb_data = data;
+}
+
+bool sd_profile_enabled() {
+    return sd_profile_cb != NULL;
+}
+
+static size_t get_peak_host_memory() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#if defined(__APPLE__) && defined(__MACH__)
+    return (size_t)usage.ru_maxrss;  // bytes
+#else
+    return (size_t)usage.ru_maxrss * 1024;  // KB
+#endif
+#endif
+}
+
+void sd_profile_report(sd_profile_event_t& event) {
+    if (sd_profile_cb == NULL) {
+        return;
+    }
+    event.peak_host_memory   = get_peak_host_memory();
+    event.peak_device_memory = (size_t)device_memory_peak.load();
+    sd_profile_cb(&event, sd_profile_cb_data);
+}
+
+void sd_profile_stage(const char* name, int64_t time_us) {
+    if (sd_profile_cb == NULL) {
+        return;
+    }
+    sd_profile_event_t event = {};
+    event.type               = SD_PROFILE_STAGE;
+    event.name               = name;
+    event.time_us            = time_us;
+    sd_profile_report(event);
+}
+
+void sd_profile_step(int step, int steps, int64_t time_us) {
+    if (sd_profile_cb == NULL) {
+        return;
+    }
+    sd_profile_event_t event = {};
+    event.type               = SD_PROFILE_STEP;
+    event.name               = "step";
+    event.step               = step;
+    event.steps              = steps;
+    event.time_us            = time_us;
+    sd_profile_report(event);
+}
+
+void sd_track_device_memory(int64_t delta) {
+    int64_t current = device_memory += delta;
+    int64_t peak    = device_memory_peak.load();
+    while (current > peak && !device_memory_peak.compare_exchange_weak(peak, current)) {
+    }
+}
 const char* sd_get_system_info() {
     static char buffer[1024];
     std::stringstream ss;
@@ -636,44 +925,74 @@ std::vector<std::pair<std::string, float>> parse_prompt_attention(const std::str
     float round_bracket_multiplier  = 1.1f;
     float square_bracket_multiplier = 1 / 1.1f;
 
-    std::regex re_attention(R"(\\\(|\\\)|\\\[|\\\]|\\\\|\\|\(|\[|:([+-]?[.\d]+)\)|\)|\]|[^\\()\[\]:]+|:)");
-    std::regex re_break(R"(\s*\bBREAK\b\s*)");
-
     auto multiply_range = [&](int start_position, float multiplier) {
         for (int p = start_position; p < res.size(); ++p) {
             res[p].second *= multiplier;
         }
     };
 
-    std::smatch m;
-    std::string remaining_text = text;
+    // splits off the next token, same as the regex
+    // \\\(|\\\)|\\\[|\\\]|\\\\|\\|\(|\[|:([+-]?[.\d]+)\)|\)|\]|[^\\()\[\]:]+|:
+    auto next_token = [](const std::string& s, size_t pos, std::string& weight) -> size_t {
+        auto is_special = [](char c) {
+            return c == '\\' || c == '(' || c == ')' || c == '[' || c == ']' || c == ':';
+        };
+        char c = s[pos];
+        if (c == '\\') {
+            return pos + 1 < s.size() && is_special(s[pos + 1]) && s[pos + 1] != ':' ? 2 : 1;
+        }
+        if (c == ':') {
+            size_t end = pos + 1;
+            if (end < s.size() && (s[end] == '+' || s[end] == '-')) {
+                end++;
+            }
+            size_t digits = end;
+            while (end < s.size() && (s[end] == '.' || (s[end] >= '0' && s[end] <= '9'))) {
+                end++;
+            }
+            if (end > digits && end < s.size() && s[end] == ')') {
+                weight = s.substr(pos + 1, end - pos - 1);
+                return end + 1 - pos;
+            }
+            return 1;
+        }
+        if (is_special(c)) {
+            return 1;
+        }
+        size_t end = pos;
+        while (end < s.size() && !is_special(s[end])) {
+            end++;
+        }
+        return end - pos;
+    };
 
-    while (std::regex_search(remaining_text, m, re_attention)) {
-        std::string text   = m[0];
-        std::string weight = m[1];
+    size_t pos = 0;
+    while (pos < text.size()) {
+        std::string weight;
+        size_t len        = next_token(text, pos, weight);
+        std::string token = text.substr(pos, len);
+        pos += len;
 
-        if (text == "(") {
+        if (token == "(") {
             round_brackets.push_back((int)res.size());
-        } else if (text == "[") {
+        } else if (token == "[") {
             square_brackets.push_back((int)res.size());
         } else if (!weight.empty()) {
             if (!round_brackets.empty()) {
                 multiply_range(round_brackets.back(), std::stof(weight));
                 round_brackets.pop_back();
             }
-        } else if (text == ")" && !round_brackets.empty()) {
+        } else if (token == ")" && !round_brackets.empty()) {
             multiply_range(round_brackets.back(), round_bracket_multiplier);
             round_brackets.pop_back();
-        } else if (text == "]" && !square_brackets.empty()) {
+        } else if (token == "]" && !square_brackets.empty()) {
             multiply_range(square_brackets.back(), square_bracket_multiplier);
             square_brackets.pop_back();
-        } else if (text == "\\(") {
-            res.push_back({text.substr(1), 1.0f});
+        } else if (token == "\\(") {
+            res.push_back({token.substr(1), 1.0f});
         } else {
-            res.push_back({text, 1.0f});
+            res.push_back({token, 1.0f});
         }
-
-        remaining_text = m.suffix();
     }
 
     for (int pos : round_brackets) {
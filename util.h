@@ -2,6 +2,8 @@
 #define __UTIL_H__
 
 #include <cstdint>
+#include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -21,6 +23,34 @@ std::string get_full_path(const std::string& dir, const std::string& filename);
 
 std::vector<std::string> get_files_from_dir(const std::string& dir);
 
+// runs fn(begin, end) over [0, n) split in contiguous ranges, at most n_threads of them and
+// each at least min_per_thread long. The ranges run on a pool of threads kept between calls,
+// n_threads <= 0 uses the physical cores. A call made while another one runs stays serial.
+void sd_parallel_for(int n_threads,
+                     int64_t n,
+                     int64_t min_per_thread,
+                     const std::function<void(int64_t, int64_t)>& fn);
+
+// read-only mapping of a whole file, pages are read ahead sequentially
+class MmapFile {
+public:
+    static std::unique_ptr<MmapFile> open(const std::string& filename);
+    ~MmapFile();
+
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    MmapFile() = default;
+
+    uint8_t* data_ = nullptr;
+    size_t size_   = 0;
+#ifdef _WIN32
+    void* file_    = nullptr;
+    void* mapping_ = nullptr;
+#endif
+};
+
 std::u32string utf8_to_utf32(const std::string& utf8_str);
 std::string utf32_to_utf8(const std::u32string& utf32_str);
 std::u32string unicode_value_to_utf32(int unicode_value);
@@ -48,6 +78,18 @@ std::string path_join(const std::string& p1, const std::string& p2);
 std::vector<std::string> splitString(const std::string& str, char delimiter);
 void pretty_progress(int step, int steps, float time);
 
+bool sd_image_cb_enabled();
+// hands a generated image over to the image callback
+void sd_image_ready(int index, sd_image_t image);
+
+bool sd_profile_enabled();
+// fills in the memory peaks and passes the event to the profile callback
+void sd_profile_report(sd_profile_event_t& event);
+void sd_profile_stage(const char* name, int64_t time_us);
+void sd_profile_step(int step, int steps, int64_t time_us);
+// backend buffers outside of RAM, delta in bytes
+void sd_track_device_memory(int64_t delta);
+
 void log_printf(sd_log_level_t level, const char* file, int line, const char* format, ...);
 
 std::string trim(const std::string& s);
@@ -564,7 +564,8 @@ struct AutoEncoderKL : public GGMLRunner {
         };
         // ggml_set_f32(z, 0.5f);
         // print_ggml_tensor(z);
-        GGMLRunner::compute(get_graph, n_threads, true, output, output_ctx);
+        // tiles share the graph, the caller frees the compute buffer when done
+        GGMLRunner::compute_cached(get_graph, {z}, decode_graph ? "decode" : "encode", n_threads, output, output_ctx);
     }
 
     void test() {